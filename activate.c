@@ -29,38 +29,113 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 
 #include "irqbalance.h"
 
-static int check_affinity(struct irq_info *info, cpumask_t applied_mask)
+/*
+ * Moves queued up by activate_mappings(): each irq with the mask it is to
+ * get, and the file I/O to check and apply that mask
+ */
+struct pending_move {
+	struct irq_info *info;
+	cpumask_id_t mask;
+	int op;			/* its io_op in the batch being run, or -1 */
+	int fresh;		/* its mask was read or written this cycle */
+};
+
+static struct pending_move *moves;
+static struct io_op *move_ops;
+static char *move_bufs;
+static int moves_count;
+static int moves_size;
+static size_t move_buf_len;
+
+/*
+ * Each irq remembers the last mask we gave the kernel, so that we needn't
+ * read smp_affinity back before every write.  Anyone else may change the
+ * mask behind our back though, so every AFFINITY_SWEEP_CYCLES cycles the
+ * remembered masks expire and are read again as the irqs move.
+ */
+#define AFFINITY_SWEEP_CYCLES 30
+
+static unsigned int affinity_gen = 1;
+static unsigned int affinity_cycles;
+
+/* cleared if the kernel has no smp_affinity_list */
+static int use_affinity_list = 1;
+
+/* cleared if the kernel doesn't report effective affinity */
+static int use_effective_affinity = 1;
+
+static int affinity_known(struct irq_info *info)
+{
+	return info->applied_gen == affinity_gen;
+}
+
+static void set_applied_mask(struct irq_info *info, cpumask_id_t mask)
+{
+	info->applied_mask = mask;
+	info->applied_gen = affinity_gen;
+}
+
+/*
+ * Take the mask read from smp_affinity as the one the irq has now.  Only
+ * the masks we hand out are interned, any other one is recorded as
+ * CPUMASK_ID_EMPTY, which just makes sure the move gets written.
+ */
+static void check_affinity(struct io_op *op, struct pending_move *move)
 {
+	struct irq_info *info = move->info;
 	cpumask_t current_mask;
-	char buf[PATH_MAX];
-	char *line = NULL;
-	size_t size = 0;
-	FILE *file;
-
-	sprintf(buf, "/proc/irq/%i/smp_affinity", info->irq);
-	file = fopen(buf, "r");
-	if (!file)
-		return 1;
-	if (getline(&line, &size, file)==0) {
-		free(line);
-		fclose(file);
-		return 1;
-	}
-	cpumask_parse_user(line, strlen(line), current_mask);
-	fclose(file);
-	free(line);
+	cpumask_id_t id;
+
+	if (op->result <= 0)
+		return;
+	cpumask_parse_user(op->buf, op->result, current_mask);
+
+	if (info->applied_mask != CPUMASK_ID_EMPTY &&
+	    cpus_equal(current_mask, *cpumask_of_id(info->applied_mask)))
+		id = info->applied_mask;
+	else if (cpus_equal(current_mask, *cpumask_of_id(move->mask)))
+		id = move->mask;
+	else
+		id = CPUMASK_ID_EMPTY;
+
+	if (info->applied_mask != CPUMASK_ID_EMPTY && info->applied_mask != id)
+		log(TO_CONSOLE, LOG_INFO, "irq %d affinity was changed outside of irqbalance\n",
+		    info->irq);
+	set_applied_mask(info, id);
+}
+
+static int grow_moves(void)
+{
+	/* room for a mask in the "%08x," format of cpumask_scnprintf */
+	size_t buf_len = (nr_cpumask_bits + 31) / 32 * 9 + 2;
+	int size = moves_size ? moves_size * 2 : 64;
+	void *p;
 
-	return cpus_equal(applied_mask, current_mask);
+	p = realloc(moves, size * sizeof(struct pending_move));
+	if (!p)
+		return -1;
+	moves = p;
+	p = realloc(move_ops, size * sizeof(struct io_op));
+	if (!p)
+		return -1;
+	move_ops = p;
+	p = realloc(move_bufs, size * buf_len);
+	if (!p)
+		return -1;
+	move_bufs = p;
+	moves_size = size;
+	move_buf_len = buf_len;
+	return 0;
 }
 
-static void activate_mapping(struct irq_info *info, void *data __attribute__((unused)))
+static void queue_mapping(struct irq_info *info, void *data __attribute__((unused)))
 {
-	char buf[PATH_MAX];
-	FILE *file;
-	cpumask_t applied_mask;
+	cpumask_id_t applied_mask = CPUMASK_ID_EMPTY;
 	int valid_mask = 0;
 
 	/*
@@ -70,8 +145,8 @@ static void activate_mapping(struct irq_info *info, void *data __attribute__((un
 		return;
 
 	if ((hint_policy == HINT_POLICY_EXACT) &&
-	    (!cpus_empty(info->affinity_hint))) {
-		if (cpus_intersects(info->affinity_hint, banned_cpus))
+	    (!cpumask_id_empty(info->affinity_hint))) {
+		if (cpus_intersects(*cpumask_of_id(info->affinity_hint), banned_cpus))
 			log(TO_ALL, LOG_WARNING,
 			    "irq %d affinity_hint and banned cpus confict\n",
 			    info->irq);
@@ -82,9 +157,9 @@ static void activate_mapping(struct irq_info *info, void *data __attribute__((un
 	} else if (info->assigned_obj) {
 		applied_mask = info->assigned_obj->mask;
 		if ((hint_policy == HINT_POLICY_SUBSET) &&
-		    (!cpus_empty(info->affinity_hint))) {
-			cpus_and(applied_mask, applied_mask, info->affinity_hint);
-			if (!cpus_intersects(applied_mask, unbanned_cpus))
+		    (!cpumask_id_empty(info->affinity_hint))) {
+			applied_mask = cpumask_id_and(applied_mask, info->affinity_hint);
+			if (!cpus_intersects(*cpumask_of_id(applied_mask), unbanned_cpus))
 				log(TO_ALL, LOG_WARNING,
 				    "irq %d affinity_hint subset empty\n",
 				   info->irq);
@@ -98,24 +173,220 @@ static void activate_mapping(struct irq_info *info, void *data __attribute__((un
 	/*
  	 * Don't activate anything for which we have an invalid mask 
  	 */
-	if (!valid_mask || check_affinity(info, applied_mask))
+	if (!valid_mask || !info->assigned_obj)
 		return;
 
-	if (!info->assigned_obj)
+	if (moves_count == moves_size && grow_moves())
 		return;
 
-	sprintf(buf, "/proc/irq/%i/smp_affinity", info->irq);
-	file = fopen(buf, "w");
-	if (!file)
+	moves[moves_count].info = info;
+	moves[moves_count].mask = applied_mask;
+	moves_count++;
+}
+
+/*
+ * Set up io_op n of the batch to read or write the affinity of move
+ */
+static void set_move_op(struct pending_move *move, int n, int write)
+{
+	struct io_op *op = &move_ops[n];
+	const cpumask_t *mask = cpumask_of_id(move->mask);
+	int irq = move->info->irq;
+
+	move->op = n;
+	op->write = write;
+	op->buf = move_bufs + n * move_buf_len;
+	op->len = move_buf_len;
+
+	if (!write) {
+		snprintf(op->path, sizeof(op->path), "/proc/irq/%i/smp_affinity", irq);
 		return;
+	}
 
-	cpumask_scnprintf(buf, PATH_MAX, applied_mask);
-	fprintf(file, "%s", buf);
-	fclose(file);
-	info->moved = 0; /*migration is done*/
+	/*
+	 * The list form is much the shorter for the usual masks, but can
+	 * come out longer than the hex one for a scattered mask
+	 */
+	if (use_affinity_list) {
+		op->len = cpulist_scnprintf(op->buf, move_buf_len, *mask);
+		if (op->len && op->len < move_buf_len - 1) {
+			snprintf(op->path, sizeof(op->path), "/proc/irq/%i/smp_affinity_list", irq);
+			return;
+		}
+	}
+	snprintf(op->path, sizeof(op->path), "/proc/irq/%i/smp_affinity", irq);
+	cpumask_scnprintf(op->buf, move_buf_len, *mask);
+	op->len = strlen(op->buf);
+}
+
+static void set_effective_op(struct pending_move *move, int n)
+{
+	struct io_op *op = &move_ops[n];
+
+	move->op = n;
+	op->write = 0;
+	op->buf = move_bufs + n * move_buf_len;
+	op->len = move_buf_len;
+	snprintf(op->path, sizeof(op->path), "/proc/irq/%i/effective_affinity_list",
+		 move->info->irq);
 }
 
+static int is_affinity_list(struct io_op *op)
+{
+	size_t len = strlen(op->path);
+
+	return len > 5 && !strcmp(op->path + len - 5, "_list");
+}
+
+/*
+ * Tells a kernel without effective_affinity_list from an irq that has
+ * just gone away
+ */
+static int irq_exists(int irq)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/proc/irq/%i", irq);
+	return !access(path, F_OK);
+}
+
+static void forget_effective_affinity(struct irq_info *info, void *data __attribute__((unused)))
+{
+	info->effective_mask = CPUMASK_ID_EMPTY;
+}
+
+/*
+ * A mask of more than one cpu usually has the kernel deliver the irq to
+ * just one of them.  Read back which, so that the balancer can tell which
+ * cpu the irq really loads.  Only done for the masks written this cycle and
+ * the ones the periodic sweep read.
+ */
+static void read_effective_affinity(void)
+{
+	struct pending_move *move;
+	struct io_op *op;
+	cpumask_t mask;
+	int i, n;
+
+	if (!use_effective_affinity)
+		return;
+
+	for (i = n = 0; i < moves_count; i++) {
+		move = &moves[i];
+		move->op = -1;
+		if (move->fresh && affinity_known(move->info) &&
+		    move->info->applied_mask == move->mask)
+			set_effective_op(move, n++);
+	}
+	io_batch_run(move_ops, n);
+
+	for (i = 0; i < moves_count; i++) {
+		move = &moves[i];
+		if (move->op < 0)
+			continue;
+		op = &move_ops[move->op];
+		move->info->effective_mask = CPUMASK_ID_EMPTY;
+		if (op->result == -ENOENT && irq_exists(move->info->irq))
+			use_effective_affinity = 0;
+		if (op->result <= 0 || (size_t)op->result >= move_buf_len - 1)
+			continue;
+		if (!cpulist_parse(op->buf, mask))
+			move->info->effective_mask = intern_cpumask(&mask);
+	}
+
+	if (!use_effective_affinity) {
+		log(TO_CONSOLE, LOG_INFO, "No effective_affinity_list, taking irqs to load all cpus they may use\n");
+		for_each_irq(NULL, forget_effective_affinity, NULL);
+	}
+}
+
+/*
+ * Apply the masks of all moved irqs.  The current masks are only read,
+ * in one batch, for irqs whose last mask we don't know.  The ones that
+ * differ are written in a second batch, and where the kernel really
+ * delivers the irqs is read back in a third.
+ */
 void activate_mappings(void)
 {
-	for_each_irq(NULL, activate_mapping, NULL);
+	struct pending_move *move;
+	struct io_op *op;
+	int had_list, list;
+	int i, n;
+
+	if (++affinity_cycles >= AFFINITY_SWEEP_CYCLES) {
+		affinity_cycles = 0;
+		affinity_gen++;
+	}
+
+	moves_count = 0;
+	for_each_irq(NULL, queue_mapping, NULL);
+	if (!moves_count)
+		return;
+
+	for (i = n = 0; i < moves_count; i++) {
+		move = &moves[i];
+		move->op = -1;
+		if (!affinity_known(move->info))
+			set_move_op(move, n++, 0);
+	}
+	io_batch_run(move_ops, n);
+
+	for (i = 0; i < moves_count; i++) {
+		moves[i].fresh = moves[i].op >= 0;
+		if (moves[i].fresh)
+			check_affinity(&move_ops[moves[i].op], &moves[i]);
+	}
+
+	/*
+	 * An irq whose mask we couldn't read is left alone.  One that
+	 * already has its mask is done with, without any I/O.
+	 */
+	for (i = n = 0; i < moves_count; i++) {
+		move = &moves[i];
+		move->op = -1;
+		if (!affinity_known(move->info))
+			continue;
+		if (move->info->applied_mask == move->mask)
+			move->info->moved = 0;
+		else
+			set_move_op(move, n++, 1);
+	}
+	io_batch_run(move_ops, n);
+
+	/*
+	 * Kernels before 2.6.37 only have the hex form.  An irq that has just
+	 * gone away looks the same, so only a hex write that works proves the
+	 * list file is missing.
+	 */
+	had_list = use_affinity_list;
+	for (i = 0; i < moves_count; i++) {
+		move = &moves[i];
+		if (move->op < 0)
+			continue;
+		op = &move_ops[move->op];
+		if (op->result != -ENOENT || !is_affinity_list(op))
+			continue;
+		list = use_affinity_list;
+		use_affinity_list = 0;
+		set_move_op(move, move->op, 1);
+		io_batch_run(op, 1);
+		if (op->result < 0)
+			use_affinity_list = list;
+	}
+	if (had_list && !use_affinity_list)
+		log(TO_CONSOLE, LOG_INFO, "No smp_affinity_list, writing hex masks\n");
+
+	for (i = 0; i < moves_count; i++) {
+		move = &moves[i];
+		if (move->op < 0 || !move_ops[move->op].opened)
+			continue;
+		move->info->moved = 0; /*migration is done*/
+		if (move_ops[move->op].result >= 0) {
+			set_applied_mask(move->info, move->mask);
+			move->fresh = 1;
+		} else
+			move->info->applied_gen = 0;
+	}
+
+	read_effective_affinity();
 }
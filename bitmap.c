@@ -87,6 +87,40 @@ int __bitmap_weight(const unsigned long *bitmap, int bits)
 	return w;
 }
 
+/*
+ * find_next_bit - find the next set bit in a bitmap
+ *   @addr - bitmap to search
+ *   @bits - bitmap size, in bits
+ *   @offset - bit number to start searching at
+ *
+ * Returns the bit number of the next set bit at or after @offset,
+ * or @bits if there is none.
+ */
+int find_next_bit(const unsigned long *addr, int bits, int offset)
+{
+	int k, lim = BITS_TO_LONGS(bits);
+	unsigned long word;
+
+	if (offset >= bits)
+		return bits;
+
+	k = offset / BITS_PER_LONG;
+	word = addr[k] & (~0UL << (offset % BITS_PER_LONG));
+	while (!word) {
+		if (++k >= lim)
+			return bits;
+		word = addr[k];
+	}
+
+	offset = k * BITS_PER_LONG + __builtin_ctzl(word);
+	return offset < bits ? offset : bits;
+}
+
+int find_first_bit(const unsigned long *addr, int bits)
+{
+	return find_next_bit(addr, bits, 0);
+}
+
 int __bitmap_equal(const unsigned long *bitmap1,
 		const unsigned long *bitmap2, int bits)
 {
@@ -299,6 +333,67 @@ int bitmap_scnprintf(char *buf, unsigned int buflen,
 	return len;
 }
 
+/*
+ * Helper routine for bitmap_scnlistprintf(), emits the range rbot-rtop,
+ * or the single bit rbot, after a comma if anything came before.  Output
+ * that doesn't fit is cut short.
+ */
+static int bscnl_emit(char *buf, unsigned int buflen, int rbot, int rtop, int len)
+{
+	char range[32];
+	int n;
+
+	if (rbot == rtop)
+		n = snprintf(range, sizeof(range), "%s%d", len ? "," : "", rbot);
+	else
+		n = snprintf(range, sizeof(range), "%s%d-%d", len ? "," : "", rbot, rtop);
+	if ((unsigned int)(len + n) >= buflen)
+		n = buflen - len - 1;
+	memcpy(buf + len, range, n);
+	buf[len + n] = 0;
+	return len + n;
+}
+
+/**
+ * bitmap_scnlistprintf - convert bitmap to list format ASCII string
+ * @buf: byte buffer into which string is placed
+ * @buflen: reserved size of @buf, in bytes
+ * @maskp: pointer to bitmap to convert
+ * @nmaskbits: size of bitmap, in bits
+ *
+ * Output format is a comma-separated list of decimal numbers and
+ * ranges.  Consecutively set bits are shown as two hyphen-separated
+ * decimal numbers, the smallest and largest bit numbers set in
+ * the range.  Output format is compatible with the format
+ * accepted as input by bitmap_parselist().
+ *
+ * The return value is the number of characters which were output,
+ * excluding the trailing '\0'.  A return value of @buflen - 1 means
+ * the list may have been cut short.
+ */
+int bitmap_scnlistprintf(char *buf, unsigned int buflen,
+	const unsigned long *maskp, int nmaskbits)
+{
+	int len = 0;
+	/* current bit is 'cur', most recently seen range is [rbot, rtop] */
+	int cur, rbot, rtop;
+
+	if (buflen == 0)
+		return 0;
+	buf[0] = 0;
+
+	rbot = cur = find_first_bit(maskp, nmaskbits);
+	while (cur < nmaskbits) {
+		rtop = cur;
+		cur = find_next_bit(maskp, nmaskbits, cur+1);
+		if (cur >= nmaskbits || cur > rtop + 1) {
+			len = bscnl_emit(buf, buflen, rbot, rtop, len);
+			rbot = cur;
+		}
+	}
+	return len;
+}
+
 /**
  * __bitmap_parse - convert an ASCII hex string into a bitmap.
  * @buf: pointer to buffer containing string.
@@ -377,3 +472,52 @@ int __bitmap_parse(const char *buf, unsigned int buflen,
 
 	return 0;
 }
+
+/**
+ * bitmap_parselist - convert list format ASCII string to bitmap
+ * @bp: read nul-terminated user string from this buffer
+ * @maskp: write resulting mask here
+ * @nmaskbits: number of bits in mask to be written
+ *
+ * Input format is a comma-separated list of decimal numbers and
+ * ranges.  Consecutively set bits are shown as two hyphen-separated
+ * decimal numbers, the smallest and largest bit numbers set in
+ * the range.  A trailing newline is accepted.
+ *
+ * Returns 0 on success, -errno on invalid input strings.
+ * Error values:
+ *    %-EINVAL: second number in range smaller than first
+ *    %-EINVAL: invalid character in string
+ *    %-ERANGE: bit number specified too large for mask
+ */
+int bitmap_parselist(const char *bp, unsigned long *maskp, int nmaskbits)
+{
+	unsigned long a, b;
+	char *end;
+
+	bitmap_zero(maskp, nmaskbits);
+	do {
+		if (!isdigit(*bp))
+			return -EINVAL;
+		b = a = strtoul(bp, &end, BASEDEC);
+		bp = end;
+		if (*bp == '-') {
+			bp++;
+			if (!isdigit(*bp))
+				return -EINVAL;
+			b = strtoul(bp, &end, BASEDEC);
+			bp = end;
+		}
+		if (!(a <= b))
+			return -EINVAL;
+		if (b >= (unsigned long)nmaskbits)
+			return -ERANGE;
+		while (a <= b) {
+			set_bit(a, maskp);
+			a++;
+		}
+		if (*bp == ',')
+			bp++;
+	} while (*bp != '\0' && *bp != '\n');
+	return 0;
+}
@@ -23,57 +23,22 @@
 
 static inline unsigned int hweight32(unsigned int w)
 {
-        unsigned int res = w - ((w >> 1) & 0x55555555);
-        res = (res & 0x33333333) + ((res >> 2) & 0x33333333);
-        res = (res + (res >> 4)) & 0x0F0F0F0F;
-        res = res + (res >> 8);
-        return (res + (res >> 16)) & 0x000000FF;
+	return __builtin_popcount(w);
 }
 
 static inline unsigned long hweight64(uint64_t w)
 {
-	if (BITS_PER_LONG == 32) 
-	        return hweight32((unsigned int)(w >> 32)) + hweight32((unsigned int)w);
-
-        w -= (w >> 1) & 0x5555555555555555ull;
-        w =  (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
-        w =  (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0full;
-        return (w * 0x0101010101010101ull) >> 56;
+	return __builtin_popcountll(w);
 }
 
-
 static inline int fls(int x)
 {
-        int r = 32;
-
-        if (!x)
-                return 0;
-        if (!(x & 0xffff0000u)) {
-                x <<= 16;
-                r -= 16;
-        }
-        if (!(x & 0xff000000u)) {
-                x <<= 8;
-                r -= 8;
-        }
-        if (!(x & 0xf0000000u)) {
-                x <<= 4;
-                r -= 4;
-        }
-        if (!(x & 0xc0000000u)) {
-                x <<= 2;
-                r -= 2;
-        }
-        if (!(x & 0x80000000u)) {
-                x <<= 1;
-                r -= 1;
-        }
-        return r;
+	return x ? 32 - __builtin_clz((unsigned int)x) : 0;
 }
 
 static inline unsigned long hweight_long(unsigned long w)
 {
-        return sizeof(w) == 4 ? hweight32(w) : hweight64(w);
+	return __builtin_popcountl(w);
 }
 
 #define min(x,y) ({ \
@@ -180,6 +145,8 @@ extern int __bitmap_intersects(const unsigned long *bitmap1,
 extern int __bitmap_subset(const unsigned long *bitmap1,
 			const unsigned long *bitmap2, int bits);
 extern int __bitmap_weight(const unsigned long *bitmap, int bits);
+extern int find_first_bit(const unsigned long *addr, int bits);
+extern int find_next_bit(const unsigned long *addr, int bits, int offset);
 
 extern int bitmap_scnprintf(char *buf, unsigned int len,
 			const unsigned long *src, int nbits);
@@ -4,7 +4,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <assert.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "irqbalance.h"
 #include "types.h"
@@ -60,29 +64,201 @@ struct user_irq_policy {
 };
 
 static GList *interrupts_db;
+static GList *interrupts_db_tail;
 static GList *banned_irqs;
 
+/*
+ * What we learned about a pci function the last time its irqs were added.
+ * It outlives rebuilds of the db so that a rescan neither re-reads the
+ * attributes nor re-runs the policy and ban scripts for devices that are
+ * still there.  An entry is dropped when a uevent says the device changed,
+ * or when a rebuild no longer finds it.
+ */
+struct dev_irq_policy {
+	int irq;
+	struct user_irq_policy pol;
+	int banned;
+	unsigned int seen;
+};
+
+struct dev_attrs {
+	int class;		/* major pci class code, -1 if unknown */
+	int numa_node;
+	cpumask_t local_cpus;
+};
+
+struct dev_cache {
+	char name[32];		/* pci address, the directory name in SYSDEV_DIR */
+	int class;		/* major pci class code, -1 if unknown */
+	int numa_node;
+	cpumask_id_t local_cpus;
+	struct dev_irq_policy *irqs;
+	int nr_irqs;
+	int irqs_size;
+	unsigned int seen;
+};
+
+static GList *dev_cache_list;
+static unsigned int dev_cache_generation;
+
+/*
+ * Every irq_info in the db, banned ones included, comes from this pool
+ */
+static struct obj_pool irq_pool = OBJ_POOL_INIT(struct irq_info, 256);
+
+struct irq_counters irq_counters;
+
+/*
+ * Direct mapped table from irq number to its irq_info.  Both the entries
+ * on interrupts_db and those on banned_irqs are indexed here, so that
+ * lookups by irq number don't need to walk either list.
+ */
+static struct irq_info **irq_index;
+static int irq_index_size;
+
 #define SYSDEV_DIR "/sys/bus/pci/devices"
 
-static gint compare_ints(gconstpointer a, gconstpointer b)
+static struct irq_info *irq_index_get(int irq)
+{
+	if (irq < 0 || irq >= irq_index_size)
+		return NULL;
+	return irq_index[irq];
+}
+
+static int irq_index_set(int irq, struct irq_info *info)
+{
+	struct irq_info **new_index;
+	int new_size;
+
+	if (irq < 0)
+		return -1;
+
+	if (irq >= irq_index_size) {
+		new_size = irq_index_size ? irq_index_size : 256;
+		while (new_size <= irq)
+			new_size *= 2;
+		new_index = realloc(irq_index, new_size * sizeof(struct irq_info *));
+		if (!new_index)
+			return -1;
+		memset(&new_index[irq_index_size], 0,
+		       (new_size - irq_index_size) * sizeof(struct irq_info *));
+		irq_index = new_index;
+		irq_index_size = new_size;
+	}
+
+	irq_index[irq] = info;
+	return 0;
+}
+
+/*
+ * Hand out the next dense counter slot to info, growing the counter
+ * arrays as needed.  Slots are handed back by irq_slot_release(), or all at
+ * once when the db is rebuilt.
+ */
+static int irq_slot_alloc(struct irq_info *info)
 {
-	const struct irq_info *ai = a;
-	const struct irq_info *bi = b;
+	void *p;
+	int new_size;
+
+	if (irq_counters.count == irq_counters.size) {
+		new_size = irq_counters.size ? irq_counters.size * 2 : 256;
+		p = realloc(irq_counters.load, new_size * sizeof(uint64_t));
+		if (!p)
+			return -1;
+		irq_counters.load = p;
+		p = realloc(irq_counters.info, new_size * sizeof(struct irq_info *));
+		if (!p)
+			return -1;
+		irq_counters.info = p;
+		if (irq_counters.columns) {
+			p = realloc(irq_counters.cpu_now,
+				    new_size * irq_counters.columns * sizeof(unsigned int));
+			if (!p)
+				return -1;
+			irq_counters.cpu_now = p;
+			p = realloc(irq_counters.cpu_last,
+				    new_size * irq_counters.columns * sizeof(unsigned int));
+			if (!p)
+				return -1;
+			irq_counters.cpu_last = p;
+		}
+		irq_counters.size = new_size;
+	}
+
+	info->slot = irq_counters.count++;
+	irq_counters.info[info->slot] = info;
+	irq_counters.load[info->slot] = 0;
+	if (irq_counters.columns) {
+		memset(irq_cpu_now(info), 0, irq_counters.columns * sizeof(unsigned int));
+		memset(irq_cpu_last(info), 0, irq_counters.columns * sizeof(unsigned int));
+	}
+	return 0;
+}
+
+/*
+ * Give the slot of info back, moving the last slot into the hole so the
+ * counter arrays stay dense
+ */
+static void irq_slot_release(struct irq_info *info)
+{
+	int last = irq_counters.count - 1;
+	struct irq_info *moved;
+
+	if (info->slot != last) {
+		moved = irq_counters.info[last];
+		moved->slot = info->slot;
+		irq_counters.info[moved->slot] = moved;
+		irq_counters.load[moved->slot] = irq_counters.load[last];
+		if (irq_counters.columns) {
+			memcpy(irq_cpu_now(moved),
+			       &irq_counters.cpu_now[(size_t)last * irq_counters.columns],
+			       irq_counters.columns * sizeof(unsigned int));
+			memcpy(irq_cpu_last(moved),
+			       &irq_counters.cpu_last[(size_t)last * irq_counters.columns],
+			       irq_counters.columns * sizeof(unsigned int));
+		}
+	}
+	irq_counters.count--;
+	info->slot = -1;
+}
+
+/*
+ * Resize the per cpu count matrix to the number of cpu columns in
+ * /proc/interrupts.  The per cpu history of every irq starts over.
+ */
+int set_irq_counter_columns(int columns)
+{
+	size_t len = (size_t)irq_counters.size * columns * sizeof(unsigned int);
+	void *p;
+
+	if (columns == irq_counters.columns)
+		return 0;
 
-	return ai->irq - bi->irq;
+	irq_counters.columns = 0;
+	if (len) {
+		p = realloc(irq_counters.cpu_now, len);
+		if (!p)
+			return -1;
+		irq_counters.cpu_now = p;
+		p = realloc(irq_counters.cpu_last, len);
+		if (!p)
+			return -1;
+		irq_counters.cpu_last = p;
+		memset(irq_counters.cpu_now, 0, len);
+		memset(irq_counters.cpu_last, 0, len);
+	}
+	irq_counters.columns = columns;
+	return 0;
 }
 
 void add_banned_irq(int irq)
 {
-	struct irq_info find, *new;
-	GList *entry;
+	struct irq_info *new;
 
-	find.irq = irq;
-	entry = g_list_find_custom(banned_irqs, &find, compare_ints);
-	if (entry)
+	if (irq_index_get(irq))
 		return;
 
-	new = calloc(sizeof(struct irq_info), 1);
+	new = pool_alloc(&irq_pool);
 	if (!new) {
 		log(TO_CONSOLE, LOG_WARNING, "No memory to ban irq %d\n", irq);
 		return;
@@ -91,19 +267,21 @@ void add_banned_irq(int irq)
 	new->irq = irq;
 	new->flags |= IRQ_FLAG_BANNED;
 
+	if (irq_slot_alloc(new) || irq_index_set(irq, new)) {
+		log(TO_CONSOLE, LOG_WARNING, "No memory to ban irq %d\n", irq);
+		pool_free(&irq_pool, new);
+		return;
+	}
+
 	banned_irqs = g_list_append(banned_irqs, new);
 	return;
 }
 
 static int is_banned_irq(int irq)
 {
-	GList *entry;
-	struct irq_info find;
-
-	find.irq = irq;
+	struct irq_info *info = irq_index_get(irq);
 
-	entry = g_list_find_custom(banned_irqs, &find, compare_ints);
-	return entry ? 1:0;
+	return (info && (info->flags & IRQ_FLAG_BANNED)) ? 1 : 0;
 }
 
 
@@ -114,26 +292,22 @@ static int is_banned_irq(int irq)
  */
 //  将 irq_info 结构体插入到 intterupts_db list 中
 //  devpath 指向文件系统中相关设备的目录, 如 /sys/devices/pci0000:80/0000:80:04.7
-static struct irq_info *add_one_irq_to_db(const char *devpath, int irq, struct user_irq_policy *pol)
+/*
+ * dev holds the attributes of that device, NULL for an irq without one.
+ * hint is the affinity hint of the irq, NULL if it has none.
+ */
+static struct irq_info *add_one_irq_to_db(struct dev_cache *dev, const char *devpath, int irq,
+					  struct user_irq_policy *pol, cpumask_t *hint)
 {
-	int class = 0;
-	int rc;
-	struct irq_info *new, find;
-	int numa_node;
-	char path[PATH_MAX];
-	FILE *fd;
-	char *lcpu_mask;
-	GList *entry;
-	ssize_t ret;
-	size_t blen;
+	struct irq_info *new;
+	cpumask_t mask;
 
 	/*
 	 * First check to make sure this isn't a duplicate entry
 	 * 检查该 irq 是否已经存在
 	 */
-	find.irq = irq;
-	entry = g_list_find_custom(interrupts_db, &find, compare_ints);
-	if (entry) {
+	new = irq_index_get(irq);
+	if (new && !(new->flags & IRQ_FLAG_BANNED)) {
 		log(TO_CONSOLE, LOG_INFO, "DROPPING DUPLICATE ENTRY FOR IRQ %d on path %s\n", irq, devpath);
 		return NULL;
 	}
@@ -144,91 +318,49 @@ static struct irq_info *add_one_irq_to_db(const char *devpath, int irq, struct u
 		return NULL;
 	}
 
-	new = calloc(sizeof(struct irq_info), 1);
+	new = pool_alloc(&irq_pool);
 	if (!new)
 		return NULL;
 
 	new->irq = irq;
 	new->class = IRQ_OTHER;
 
-	interrupts_db = g_list_append(interrupts_db, new);
-
-	sprintf(path, "%s/class", devpath); // 如 /sys/devices/pci0000:80/0000:80:04.7/class，设一个16进制的数
-	fd = fopen(path, "r");
-
-	if (!fd) {
-		perror("Can't open class file: ");
-		goto get_numa_node;
+	if (irq_slot_alloc(new) || irq_index_set(irq, new)) {
+		pool_free(&irq_pool, new);
+		return NULL;
 	}
 
-	rc = fscanf(fd, "%x", &class); // 读入16进制整数
-	fclose(fd);
-
-	if (!rc)
-		goto get_numa_node;
-
 	/*
-	 * Restrict search to major class code
+	 * Append through the tail pointer so building the db stays linear
 	 */
-	class >>= 16;
-
-	if (class >= MAX_CLASS)
-		goto get_numa_node;
-
-	new->class = class_codes[class];
-	if (pol->level >= 0)
-		new->level = pol->level;
+	interrupts_db_tail = g_list_append(interrupts_db_tail, new);
+	if (!interrupts_db)
+		interrupts_db = interrupts_db_tail;
 	else
-		new->level = map_class_to_level[class_codes[class]];
-
-get_numa_node:
-	numa_node = -1;
-	if (numa_avail) {
-		sprintf(path, "%s/numa_node", devpath); // 获取 numa node 值
-		fd = fopen(path, "r");
-		if (fd) {
-			rc = fscanf(fd, "%d", &numa_node);
-			fclose(fd);
-		}
+		interrupts_db_tail = g_list_next(interrupts_db_tail);
+
+	if (dev && dev->class >= 0 && dev->class < MAX_CLASS) {
+		new->class = class_codes[dev->class];
+		if (pol->level >= 0)
+			new->level = pol->level;
+		else
+			new->level = map_class_to_level[class_codes[dev->class]];
 	}
 
 	if (pol->numa_node_set == 1)
 		new->numa_node = get_numa_node(pol->numa_node);
 	else
-		new->numa_node = get_numa_node(numa_node);
-
-	sprintf(path, "%s/local_cpus", devpath);
-	fd = fopen(path, "r");
-	if (!fd) {
-		cpus_setall(new->cpumask);
-		goto assign_affinity_hint;
-	}
-	lcpu_mask = NULL;
-	ret = getline(&lcpu_mask, &blen, fd);
-	fclose(fd);
-	if (ret <= 0) {
-		cpus_setall(new->cpumask);
-	} else {
-		cpumask_parse_user(lcpu_mask, ret, new->cpumask);
-	}
-	free(lcpu_mask);
-
-assign_affinity_hint:
-	cpus_clear(new->affinity_hint);
-	sprintf(path, "/proc/irq/%d/affinity_hint", irq);
-	fd = fopen(path, "r");
-	if (!fd)
-		goto out;
-	lcpu_mask = NULL;
-	ret = getline(&lcpu_mask, &blen, fd);
-	fclose(fd);
-	if (ret <= 0)
-		goto out;
+		new->numa_node = get_numa_node(dev ? dev->numa_node : -1);
+
+	if (dev)
+		new->cpumask = dev->local_cpus;
+	else {
+		cpus_setall(mask);
+		new->cpumask = intern_cpumask(&mask);
+	}
+
+	new->affinity_hint = hint ? intern_cpumask(hint) : CPUMASK_ID_EMPTY;
 
-	// 将字符串转换成位图并赋值给affinity_hint
-	cpumask_parse_user(lcpu_mask, ret, new->affinity_hint);
-	free(lcpu_mask);
-out:
 	log(TO_CONSOLE, LOG_INFO, "Adding IRQ %d to database\n", irq);
 	return new;
 }
@@ -288,6 +420,11 @@ static void parse_user_policy_key(char *buf, struct user_irq_policy *pol)
 
 }
 
+static void parse_policy_server_line(char *line, void *data)
+{
+	parse_user_policy_key(line, data);
+}
+
 /*
  * Calls out to a possibly user defined script to get user assigned poilcy
  * aspects for a given irq.  A value of -1 in a given field indicates no
@@ -307,6 +444,12 @@ static void get_irq_user_policy(char *path, int irq, struct user_irq_policy *pol
 	if (!polscript)
 		return;
 
+	if (polscript_server) {
+		if (policy_server_query(path, irq, parse_policy_server_line, pol))
+			memset(pol, -1, sizeof(struct user_irq_policy));
+		return;
+	}
+
 	cmd = alloca(strlen(path)+strlen(polscript)+64);
 	if (!cmd)
 		return;
@@ -361,144 +504,548 @@ static int check_for_irq_ban(char *path, int irq)
  * Figures out which interrupt(s) relate to the device we're looking at in dirname
  */
 /*为该路径下的设备配置中断入口，包括msi-x以及int中断 */
-static void build_one_dev_entry(const char *dirname)
+static int dev_cache_match(gconstpointer a, gconstpointer b)
+{
+	const struct dev_cache *dev = a;
+
+	return strcmp(dev->name, b);
+}
+
+static void free_dev_cache(struct dev_cache *dev)
+{
+	free(dev->irqs);
+	free(dev);
+}
+
+/*
+ * Forget what we know about the pci function name, or about all of them
+ * if name is NULL, so that its attributes and policy are looked up afresh
+ * at the next rebuild
+ */
+void invalidate_dev_cache(const char *name)
+{
+	GList *entry, *next;
+
+	for (entry = dev_cache_list; entry; entry = next) {
+		next = g_list_next(entry);
+		if (name && dev_cache_match(entry->data, name))
+			continue;
+		free_dev_cache(entry->data);
+		dev_cache_list = g_list_delete_link(dev_cache_list, entry);
+	}
+}
+
+/*
+ * Drop the devices, and the irqs of the remaining devices, that the last
+ * rebuild didn't come across
+ */
+static void prune_dev_cache(void)
+{
+	GList *entry, *next;
+	struct dev_cache *dev;
+	int i, n;
+
+	for (entry = dev_cache_list; entry; entry = next) {
+		next = g_list_next(entry);
+		dev = entry->data;
+		if (dev->seen != dev_cache_generation) {
+			free_dev_cache(dev);
+			dev_cache_list = g_list_delete_link(dev_cache_list, entry);
+			continue;
+		}
+		for (i = n = 0; i < dev->nr_irqs; i++)
+			if (dev->irqs[i].seen == dev_cache_generation)
+				dev->irqs[n++] = dev->irqs[i];
+		dev->nr_irqs = n;
+	}
+}
+
+/*
+ * Read the attributes of the pci function whose directory is open as devfd.
+ * Only touches attrs, so it is safe to call from the scan workers.
+ */
+static void read_dev_attrs(int devfd, struct dev_attrs *attrs)
+{
+	char buf[SYSFS_ATTR_MAX];
+	ssize_t ret;
+
+	/*
+	 * Restrict search to major class code
+	 */
+	if (sysfs_read_int(devfd, "class", 16, &attrs->class)) // 一个16进制的数
+		attrs->class = -1;
+	else
+		attrs->class >>= 16;
+
+	attrs->numa_node = -1;
+	if (numa_avail)
+		sysfs_read_int(devfd, "numa_node", 10, &attrs->numa_node); // 获取 numa node 值
+
+	ret = sysfs_read_attr(devfd, "local_cpus", buf, sizeof(buf));
+	if (ret <= 0)
+		cpus_setall(attrs->local_cpus);
+	else
+		cpumask_parse_user(buf, ret, attrs->local_cpus);
+}
+
+static struct dev_cache *find_dev_cache(const char *name)
+{
+	GList *entry;
+
+	entry = g_list_find_custom(dev_cache_list, name, dev_cache_match);
+	return entry ? entry->data : NULL;
+}
+
+static struct dev_cache *add_dev_cache(const char *name, struct dev_attrs *attrs)
+{
+	struct dev_cache *dev;
+
+	if (strlen(name) >= sizeof(dev->name))
+		return NULL;
+
+	dev = calloc(1, sizeof(struct dev_cache));
+	if (!dev)
+		return NULL;
+	strcpy(dev->name, name);
+	dev->seen = dev_cache_generation;
+	dev->class = attrs->class;
+	dev->numa_node = attrs->numa_node;
+	dev->local_cpus = intern_cpumask(&attrs->local_cpus);
+
+	dev_cache_list = g_list_append(dev_cache_list, dev);
+	return dev;
+}
+
+/*
+ * Return the cached attributes of the pci function name, whose directory
+ * is open as devfd, reading them the first time it is seen
+ */
+static struct dev_cache *get_dev_cache(int devfd, const char *name)
+{
+	struct dev_cache *dev;
+	struct dev_attrs attrs;
+
+	dev = find_dev_cache(name);
+	if (dev) {
+		dev->seen = dev_cache_generation;
+		return dev;
+	}
+
+	read_dev_attrs(devfd, &attrs);
+	return add_dev_cache(name, &attrs);
+}
+
+/*
+ * Index of the cached policy of irq on dev, or -1
+ */
+static int find_dev_irq_policy(struct dev_cache *dev, int irq)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_irqs; i++)
+		if (dev->irqs[i].irq == irq)
+			return i;
+	return -1;
+}
+
+static void add_dev_irq_policy(struct dev_cache *dev, int irq,
+			       struct user_irq_policy *pol, int banned)
+{
+	struct dev_irq_policy *p;
+
+	if (dev->nr_irqs == dev->irqs_size) {
+		p = realloc(dev->irqs, (dev->irqs_size + 8) * sizeof(struct dev_irq_policy));
+		if (!p)
+			return;
+		dev->irqs = p;
+		dev->irqs_size += 8;
+	}
+
+	p = &dev->irqs[dev->nr_irqs++];
+	p->irq = irq;
+	p->pol = *pol;
+	p->banned = banned;
+	p->seen = dev_cache_generation;
+}
+
+/*
+ * Ask the policy and ban scripts about irq.  Returns 1 if the irq is to be
+ * banned.  banpath is what the ban script gets to see.
+ */
+static int run_irq_policy(char *devpath, char *banpath, int irq, struct user_irq_policy *pol)
+{
+	get_irq_user_policy(devpath, irq, pol);
+	return (pol->ban == 1) || check_for_irq_ban(banpath, irq);
+}
+
+/*
+ * Fill in the user policy of irq on dev, running the policy and ban
+ * scripts only for irqs we haven't asked them about yet.  Returns 1 if the
+ * irq is to be banned.
+ */
+static int get_dev_irq_policy(struct dev_cache *dev, char *devpath, char *banpath,
+			      int irq, struct user_irq_policy *pol)
+{
+	int banned, i;
+
+	if (!dev)
+		return run_irq_policy(devpath, banpath, irq, pol);
+
+	i = find_dev_irq_policy(dev, irq);
+	if (i >= 0) {
+		dev->irqs[i].seen = dev_cache_generation;
+		*pol = dev->irqs[i].pol;
+		return dev->irqs[i].banned;
+	}
+
+	banned = run_irq_policy(devpath, banpath, irq, pol);
+	add_dev_irq_policy(dev, irq, pol, banned);
+	return banned;
+}
+
+static int read_affinity_hint(int irq, cpumask_t *mask)
 {
-	struct dirent *entry;
-	DIR *msidir;
-	FILE *fd;
-	int irqnum;
-	struct irq_info *new;
 	char path[PATH_MAX];
-	char devpath[PATH_MAX];
+	char buf[SYSFS_ATTR_MAX];
+	ssize_t ret;
+
+	sprintf(path, "/proc/irq/%d/affinity_hint", irq);
+	ret = sysfs_read_attr(AT_FDCWD, path, buf, sizeof(buf));
+	if (ret <= 0)
+		return -1;
+
+	// 将字符串转换成位图
+	cpumask_parse_user(buf, ret, *mask);
+	return 0;
+}
+
+/*
+ * The irqs of one pci function, as found by the scan workers
+ */
+struct dev_scan_irq {
+	int irq;
+	int type;
+	int banned;
+	int cached;		/* index of the cached policy, -1 if it was just run */
+	int has_hint;
 	struct user_irq_policy pol;
+	cpumask_t hint;
+};
 
-	sprintf(path, "%s/%s/msi_irqs", SYSDEV_DIR, dirname);
-	sprintf(devpath, "%s/%s", SYSDEV_DIR, dirname);
+struct dev_scan {
+	char *name;
+	struct dev_cache *cached;	/* looked up before the scan, only read by the worker */
+	struct dev_attrs attrs;		/* read by the worker if not cached */
+	struct dev_scan_irq *irqs;
+	int nr_irqs;
+	int irqs_size;
+};
+
+static struct dev_scan_irq *add_scan_irq(struct dev_scan *scan, int irq, int type)
+{
+	struct dev_scan_irq *p;
+
+	if (scan->nr_irqs == scan->irqs_size) {
+		p = realloc(scan->irqs, (scan->irqs_size + 8) * sizeof(struct dev_scan_irq));
+		if (!p)
+			return NULL;
+		scan->irqs = p;
+		scan->irqs_size += 8;
+	}
 
-	msidir = opendir(path);
+	p = &scan->irqs[scan->nr_irqs++];
+	p->irq = irq;
+	p->type = type;
+	return p;
+}
+
+/*
+ * Each entry of msi_irqs says whether the vector is msi or msix.  On
+ * kernels where the entries are directories we can't tell, and take msix.
+ */
+static int msi_irq_type(int msifd, const char *name)
+{
+	char buf[8];
+
+	if (sysfs_read_attr(msifd, name, buf, sizeof(buf)) > 0 && !strcmp(buf, "msi\n"))
+		return IRQ_TYPE_MSI;
+	return IRQ_TYPE_MSIX;
+}
+
+/*
+ * List the irqs of the pci function whose directory is open as devfd into
+ * scan: its msi irqs if it has any, its legacy irq otherwise
+ */
+static void list_dev_irqs(int devfd, struct dev_scan *scan)
+{
+	struct dirent *entry;
+	DIR *msidir = NULL;
+	int msifd, irqnum;
+
+	msifd = sysfs_open_dir(devfd, "msi_irqs");
+	if (msifd >= 0) {
+		msidir = fdopendir(msifd);
+		if (!msidir)
+			close(msifd);
+	}
 
     // msi-x 中断
 	if (msidir) {
-		do {
-			entry = readdir(msidir);
-			if (!entry)
-				break;
+		while ((entry = readdir(msidir))) {
 			irqnum = strtol(entry->d_name, NULL, 10); // /sys/devices/pci0000:00/0000:00:04.1/msi_irqs/# 获得 irq 号
-			if (irqnum) {
-				new = get_irq_info(irqnum);
-				if (new)
-					continue;   // 已经从 interrupts_db 或者 banned_irqs 中找到，那么跳过
-				get_irq_user_policy(devpath, irqnum, &pol);
-				if ((pol.ban == 1) || (check_for_irq_ban(devpath, irqnum))) {
-					add_banned_irq(irqnum);
-					continue;
-				}
-				new = add_one_irq_to_db(devpath, irqnum, &pol);
-				if (!new)
-					continue;
-				new->type = IRQ_TYPE_MSIX;
-			}
-		} while (entry != NULL);
+			if (irqnum)
+				add_scan_irq(scan, irqnum, msi_irq_type(dirfd(msidir), entry->d_name));
+		}
 		closedir(msidir);
+	} else if (!sysfs_read_int(devfd, "irq", 10, &irqnum) && irqnum) {
+		/*
+		 * no pci device has irq 0
+		 */
+		/*对于传统中断而言，一个设备只有一个int中断号 */
+		add_scan_irq(scan, irqnum, IRQ_TYPE_LEGACY);
+	}
+}
+
+/*
+ * The ban script sees the device for msi irqs, the irq file otherwise
+ */
+static void dev_ban_path(char *path, size_t size, const char *devpath, struct dev_scan *scan)
+{
+	if (scan->nr_irqs && scan->irqs[0].type == IRQ_TYPE_LEGACY)
+		snprintf(path, size, "%s/irq", devpath);
+	else
+		snprintf(path, size, "%s", devpath);
+}
+
+/*
+ * Find the irqs of one pci function and classify them, running the user
+ * scripts where the cache doesn't already know the answer.  This runs on
+ * the scan workers, so it only reads shared state and writes to scan.
+ */
+static void scan_one_dev(int devdirfd, struct dev_scan *scan)
+{
+	struct dev_scan_irq *p;
+	int devfd, i;
+	char path[PATH_MAX + sizeof("/irq")];
+	char devpath[PATH_MAX];
+
+	devfd = sysfs_open_dir(devdirfd, scan->name);
+	if (devfd < 0)
 		return;
+
+	snprintf(devpath, PATH_MAX, "%s/%s", SYSDEV_DIR, scan->name);
+	list_dev_irqs(devfd, scan);
+	dev_ban_path(path, sizeof(path), devpath, scan);
+
+	if (scan->nr_irqs && !scan->cached)
+		read_dev_attrs(devfd, &scan->attrs);
+	close(devfd);
+
+	for (i = 0; i < scan->nr_irqs; i++) {
+		p = &scan->irqs[i];
+		p->cached = scan->cached ? find_dev_irq_policy(scan->cached, p->irq) : -1;
+		if (p->cached >= 0) {
+			p->pol = scan->cached->irqs[p->cached].pol;
+			p->banned = scan->cached->irqs[p->cached].banned;
+		} else
+			p->banned = run_irq_policy(devpath, path, p->irq, &p->pol);
+		p->has_hint = !p->banned && !read_affinity_hint(p->irq, &p->hint);
 	}
+}
 
-	sprintf(path, "%s/%s/irq", SYSDEV_DIR, dirname);
-	fd = fopen(path, "r");
-	if (!fd)
+/*
+ * Add the irqs found by scan_one_dev() to the db.  Runs on the main thread
+ * once all workers are done, in directory order, so the db comes out the
+ * same however the scan was split up.
+ */
+static void merge_one_dev(struct dev_scan *scan)
+{
+	struct dev_scan_irq *p;
+	struct dev_cache *dev;
+	struct irq_info *new;
+	char devpath[PATH_MAX];
+	int i;
+
+	if (!scan->nr_irqs)
 		return;
-	if (fscanf(fd, "%d", &irqnum) < 0)
-		goto done;
 
-	/*
-	 * no pci device has irq 0
-	 */
-	/*对于传统中断而言，一个设备只有一个int中断号，如果该中断未设置中断策略，便设置并加入中断链表中 */
-	if (irqnum) {
-		new = get_irq_info(irqnum);
-		if (new)
-			goto done;
-		get_irq_user_policy(devpath, irqnum, &pol);
-		if ((pol.ban == 1) || (check_for_irq_ban(path, irqnum))) {
-			add_banned_irq(irqnum);
-			goto done;
-		}
+	dev = scan->cached;
+	if (dev)
+		dev->seen = dev_cache_generation;
+	else
+		dev = add_dev_cache(scan->name, &scan->attrs);
+
+	snprintf(devpath, PATH_MAX, "%s/%s", SYSDEV_DIR, scan->name);
+
+	for (i = 0; i < scan->nr_irqs; i++) {
+		p = &scan->irqs[i];
+		if (get_irq_info(p->irq))
+			continue;   // 已经从 interrupts_db 或者 banned_irqs 中找到，那么跳过
+
+		if (dev && p->cached >= 0)
+			dev->irqs[p->cached].seen = dev_cache_generation;
+		else if (dev)
+			add_dev_irq_policy(dev, p->irq, &p->pol, p->banned);
 
-		new = add_one_irq_to_db(devpath, irqnum, &pol);
-		if (!new)
-			goto done;
-		new->type = IRQ_TYPE_LEGACY;
+		if (p->banned) {
+			add_banned_irq(p->irq);
+			continue;
+		}
+		new = add_one_irq_to_db(dev, devpath, p->irq, &p->pol,
+					p->has_hint ? &p->hint : NULL);
+		if (new)
+			new->type = p->type;
 	}
+}
 
-done:
-	fclose(fd);
-	return;
+#ifdef HAVE_LIBPTHREAD
+#define MAX_SCAN_THREADS 8
+
+struct scan_pool {
+	struct dev_scan *scans;
+	int count;
+	int next;
+	int devdirfd;
+	pthread_mutex_t lock;
+};
+
+static void *scan_worker(void *arg)
+{
+	struct scan_pool *pool = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count)
+			break;
+		scan_one_dev(pool->devdirfd, &pool->scans[i]);
+	}
+	return NULL;
 }
 
-static void free_irq(struct irq_info *info, void *data __attribute__((unused)))
+/*
+ * Fan the devices out over a few threads.  Most of the time goes to
+ * waiting on sysfs and on the user scripts, so this pays off even on a
+ * small machine.  The calling thread takes part, so the scan completes
+ * even if no thread can be started.
+ */
+static void scan_devices(int devdirfd, struct dev_scan *scans, int count)
 {
-	free(info);
+	struct scan_pool pool = {
+		.scans = scans,
+		.count = count,
+		.devdirfd = devdirfd,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	pthread_t threads[MAX_SCAN_THREADS];
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads, i;
+
+	nthreads = ncpus < MAX_SCAN_THREADS ? (int)ncpus : MAX_SCAN_THREADS;
+	if (nthreads > count)
+		nthreads = count;
+
+	/* the calling thread is one of them */
+	for (i = 0; i < nthreads - 1; i++)
+		if (pthread_create(&threads[i], NULL, scan_worker, &pool))
+			break;
+	nthreads = i;
+
+	scan_worker(&pool);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+#else
+static void scan_devices(int devdirfd, struct dev_scan *scans, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		scan_one_dev(devdirfd, &scans[i]);
 }
+#endif
 
 void free_irq_db(void)
 {
-	for_each_irq(NULL, free_irq, NULL);
 	g_list_free(interrupts_db);
 	interrupts_db = NULL;
-	for_each_irq(banned_irqs, free_irq, NULL);
+	interrupts_db_tail = NULL;
 	g_list_free(banned_irqs);
 	banned_irqs = NULL;
-	g_list_free(rebalance_irq_list);
-	rebalance_irq_list = NULL;
+	pool_reset(&irq_pool);
+	irq_counters.count = 0;
+	rebalance_irq_list.head = NULL;
+	rebalance_irq_list.tail = NULL;
+	rebalance_irq_list.count = 0;
+	if (irq_index)
+		memset(irq_index, 0, irq_index_size * sizeof(struct irq_info *));
 }
 
-static void add_missing_irq(struct irq_info *info, void *unused __attribute__((unused)))
-{
-	struct irq_info *lookup = get_irq_info(info->irq); // 从 list 中拿出相应 num 编号的 irq 结构
-
-	if (!lookup)
-		add_new_irq(info->irq, info);
-	
-}
-
-
 void rebuild_irq_db(void)
 {
 	DIR *devdir;
 	struct dirent *entry;
-	GList *tmp_irqs = NULL;
+	struct dev_scan *scans = NULL, *p;
+	int count = 0, size = 0, i;
 
 	free_irq_db();
-
-	tmp_irqs = collect_full_irq_list(); // 中断结构体 list
+	dev_cache_generation++;
 
 	devdir = opendir(SYSDEV_DIR); // /sys/bus/pci/devices 系统中存在的所有 pci 设备
 	if (!devdir)
-		return;
-
-	do {
-		entry = readdir(devdir);
+		goto out;
 
-		if (!entry)
+	/*
+	 * List the devices first, the cache is looked up here so the workers
+	 * never have to modify it
+	 */
+	while ((entry = readdir(devdir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (count == size) {
+			p = realloc(scans, (size ? size * 2 : 64) * sizeof(struct dev_scan));
+			if (!p)
+				break;
+			scans = p;
+			size = size ? size * 2 : 64;
+		}
+		p = &scans[count];
+		memset(p, 0, sizeof(struct dev_scan));
+		p->name = strdup(entry->d_name);
+		if (!p->name)
 			break;
+		p->cached = find_dev_cache(p->name);
+		count++;
+	}
 
-		build_one_dev_entry(entry->d_name);
+	scan_devices(dirfd(devdir), scans, count);
 
-	} while (entry != NULL);
+	for (i = 0; i < count; i++) {
+		merge_one_dev(&scans[i]);
+		free(scans[i].irqs);
+		free(scans[i].name);
+	}
+	free(scans);
 
 	closedir(devdir);
+	prune_dev_cache();
 
-
-	for_each_irq(tmp_irqs, add_missing_irq, NULL);
-
-	g_list_free_full(tmp_irqs, free);
-
+out:
+	/*
+	 * Pick up the irqs without a pci device, and the counts of all of
+	 * them, in one pass over /proc/interrupts
+	 */
+	collect_proc_interrupts();
 }
 
 struct irq_info *add_new_irq(int irq, struct irq_info *hint)
 {
 	struct irq_info *new;
 	struct user_irq_policy pol;
+	cpumask_t hint_mask;
 
 	new = get_irq_info(irq);
 	if (new)
@@ -506,11 +1053,13 @@ struct irq_info *add_new_irq(int irq, struct irq_info *hint)
 
 	get_irq_user_policy("/sys", irq, &pol);
 	if (pol.ban == 1) {
+		/* a banned irq keeps BALANCE_NONE and stays out of placement */
 		add_banned_irq(irq);
-		new = get_irq_info(irq);
-	} else
-		new = add_one_irq_to_db("/sys", irq, &pol);
+		return get_irq_info(irq);
+	}
 
+	new = add_one_irq_to_db(NULL, "/sys", irq, &pol,
+				read_affinity_hint(irq, &hint_mask) ? NULL : &hint_mask);
 	if (!new) {
 		log(TO_CONSOLE, LOG_WARNING, "add_new_irq: Failed to add irq %d\n", irq);
 		return NULL;
@@ -528,63 +1077,376 @@ struct irq_info *add_new_irq(int irq, struct irq_info *hint)
 	return new;
 }
 
-void for_each_irq(GList *list, void (*cb)(struct irq_info *info, void *data), void *data)
+/*
+ * The irqs of every pci function, listed on the first irq of a
+ * /proc/interrupts pass that the db doesn't know.  A device that brings up
+ * many vectors at once then costs one walk of sysfs, not one per vector.
+ */
+static struct dev_scan *hotplug_devs;
+static int hotplug_devs_count;
+static int hotplug_devs_size;
+static int hotplug_devs_listed;
+
+static void list_hotplug_devs(void)
 {
-	GList *entry = g_list_first(list ? list : interrupts_db);
-	GList *next;
+	DIR *devdir;
+	struct dirent *entry;
+	struct dev_scan *p;
+	int devfd;
 
-	while (entry) {
-		next = g_list_next(entry);
-		cb(entry->data, data);
-		entry = next;
+	hotplug_devs_listed = 1;
+	devdir = opendir(SYSDEV_DIR);
+	if (!devdir)
+		return;
+
+	while ((entry = readdir(devdir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (hotplug_devs_count == hotplug_devs_size) {
+			p = realloc(hotplug_devs, (hotplug_devs_size + 64) * sizeof(struct dev_scan));
+			if (!p)
+				break;
+			hotplug_devs = p;
+			hotplug_devs_size += 64;
+		}
+		p = &hotplug_devs[hotplug_devs_count];
+		memset(p, 0, sizeof(struct dev_scan));
+
+		devfd = sysfs_open_dir(dirfd(devdir), entry->d_name);
+		if (devfd < 0)
+			continue;
+		list_dev_irqs(devfd, p);
+		close(devfd);
+		if (p->nr_irqs)
+			p->name = strdup(entry->d_name);
+		if (!p->name) {
+			free(p->irqs);
+			continue;
+		}
+		hotplug_devs_count++;
 	}
+	closedir(devdir);
 }
 
-struct irq_info *get_irq_info(int irq)
+/*
+ * Drop the listing at the end of a pass, the next one may see new devices
+ */
+void forget_hotplug_devs(void)
 {
-	GList *entry;
-	struct irq_info find;
+	int i;
 
-	find.irq = irq;
-	entry = g_list_find_custom(interrupts_db, &find, compare_ints);
+	for (i = 0; i < hotplug_devs_count; i++) {
+		free(hotplug_devs[i].irqs);
+		free(hotplug_devs[i].name);
+	}
+	hotplug_devs_count = 0;
+	hotplug_devs_listed = 0;
+}
 
-	if (!entry)
-		entry = g_list_find_custom(banned_irqs, &find, compare_ints);
+static struct dev_scan *find_irq_device(int irq, int *type)
+{
+	struct dev_scan *scan;
+	int i, j;
+
+	if (!hotplug_devs_listed)
+		list_hotplug_devs();
+
+	for (i = 0; i < hotplug_devs_count; i++) {
+		scan = &hotplug_devs[i];
+		for (j = 0; j < scan->nr_irqs; j++) {
+			if (scan->irqs[j].irq == irq) {
+				*type = scan->irqs[j].type;
+				return scan;
+			}
+		}
+	}
+	return NULL;
+}
 
-	return entry ? entry->data : NULL;
+/*
+ * Add an irq that appeared in /proc/interrupts since the db was built.  If
+ * it belongs to a pci device it is classified from that device the same way
+ * rebuild_irq_db() would have, otherwise hint is used as for add_new_irq().
+ */
+struct irq_info *add_hotplug_irq(int irq, struct irq_info *hint)
+{
+	struct irq_info *new;
+	struct user_irq_policy pol;
+	struct dev_cache *dev = NULL;
+	struct dev_scan *scan;
+	cpumask_t hint_mask;
+	char path[PATH_MAX + sizeof("/irq")];
+	char devpath[PATH_MAX];
+	int devfd, type;
+
+	if (get_irq_info(irq))
+		return NULL;
+
+	scan = find_irq_device(irq, &type);
+	if (!scan)
+		return add_new_irq(irq, hint);
+
+	snprintf(devpath, PATH_MAX, "%s/%s", SYSDEV_DIR, scan->name);
+	dev_ban_path(path, sizeof(path), devpath, scan);
+	devfd = sysfs_open_dir(AT_FDCWD, devpath);
+	if (devfd >= 0) {
+		dev = get_dev_cache(devfd, scan->name);
+		close(devfd);
+	}
+
+	if (get_dev_irq_policy(dev, devpath, path, irq, &pol)) {
+		add_banned_irq(irq);
+		return get_irq_info(irq);
+	}
+
+	new = add_one_irq_to_db(dev, devpath, irq, &pol,
+				read_affinity_hint(irq, &hint_mask) ? NULL : &hint_mask);
+	if (new)
+		new->type = type;
+	return new;
 }
 
-void migrate_irq(GList **from, GList **to, struct irq_info *info)
+/*
+ * Drop an irq that no longer exists from the db, wherever it is placed
+ */
+static void remove_irq_from_db(GList *entry)
 {
-	GList *entry;
-	struct irq_info find, *tmp;
+	struct irq_info *info = entry->data;
+
+	log(TO_CONSOLE, LOG_INFO, "Removing IRQ %d from database\n", info->irq);
 
-	find.irq = info->irq;
-	entry = g_list_find_custom(*from, &find, compare_ints);
+	irq_list_del(info);
+	if (entry == interrupts_db_tail)
+		interrupts_db_tail = g_list_previous(entry);
+	interrupts_db = g_list_delete_link(interrupts_db, entry);
+	irq_index_set(info->irq, NULL);
+	irq_slot_release(info);
+	pool_free(&irq_pool, info);
+}
 
-	if (!entry)
+/*
+ * Remove the irqs that were not seen in the /proc/interrupts pass of the
+ * given generation.  Banned irqs stay, so a ban outlives the irq.
+ */
+void remove_stale_irqs(unsigned int generation)
+{
+	GList *entry, *next;
+	struct irq_info *info;
+
+	for (entry = interrupts_db; entry; entry = next) {
+		next = g_list_next(entry);
+		info = entry->data;
+		if (info->seen != generation)
+			remove_irq_from_db(entry);
+	}
+}
+
+void for_each_irq(struct irq_list *list, void (*cb)(struct irq_info *info, void *data), void *data)
+{
+	GList *entry, *next;
+	struct irq_info *info, *next_info;
+
+	if (!list) {
+		entry = g_list_first(interrupts_db);
+		while (entry) {
+			next = g_list_next(entry);
+			cb(entry->data, data);
+			entry = next;
+		}
 		return;
+	}
 
-	tmp = entry->data;
-	*from = g_list_delete_link(*from, entry);
+	info = list->head;
+	while (info) {
+		next_info = info->next;
+		cb(info, data);
+		info = next_info;
+	}
+}
 
+struct irq_info *get_irq_info(int irq)
+{
+	return irq_index_get(irq);
+}
 
-	*to = g_list_append(*to, tmp);
+void irq_list_add_tail(struct irq_list *list, struct irq_info *info)
+{
+	info->list = list;
+	info->next = NULL;
+	info->prev = list->tail;
+	if (list->tail)
+		list->tail->next = info;
+	else
+		list->head = info;
+	list->tail = info;
+	list->count++;
+}
+
+void irq_list_del(struct irq_info *info)
+{
+	struct irq_list *list = info->list;
+
+	if (!list)
+		return;
+
+	if (info->prev)
+		info->prev->next = info->next;
+	else
+		list->head = info->next;
+	if (info->next)
+		info->next->prev = info->prev;
+	else
+		list->tail = info->prev;
+	list->count--;
+
+	info->list = NULL;
+	info->prev = NULL;
+	info->next = NULL;
+}
+
+void migrate_irq(struct irq_list *from, struct irq_list *to, struct irq_info *info)
+{
+	if (info->list != from)
+		return;
+
+	irq_list_del(info);
+	irq_list_add_tail(to, info);
 	info->moved = 1;
 }
 
-static gint sort_irqs(gconstpointer A, gconstpointer B)
+/*
+ * Irq lists are ordered by class (highest first), then by load (highest
+ * first), then by irq number.  The order is packed into a composite key so
+ * that sorting is a handful of radix passes over an array snapshot of the
+ * list.  Loads are in nanoseconds per interval, which never come close to
+ * the 61 bits left for them next to the class.
+ */
+#define SORT_LOAD_BITS 61
+#define SORT_LOAD_MAX ((1ULL << SORT_LOAD_BITS) - 1)
+
+struct irq_sort_entry {
+	uint64_t key;		/* class and load */
+	uint32_t irq;
+	struct irq_info *info;
+};
+
+static struct irq_sort_entry *sort_buf;
+static unsigned int sort_buf_size;
+
+static void set_sort_key(struct irq_sort_entry *e, struct irq_info *info)
 {
-        struct irq_info *a, *b;
-        a = (struct irq_info*)A;
-        b = (struct irq_info*)B;
+	uint64_t load = irq_load(info);
+
+	if (load > SORT_LOAD_MAX)
+		load = SORT_LOAD_MAX;
+	e->key = ((uint64_t)(IRQ_VIRT_EVENT - info->class) << SORT_LOAD_BITS) |
+		 (SORT_LOAD_MAX - load);
+	e->irq = info->irq;
+	e->info = info;
+}
 
-	if (a->class < b->class || a->load < b->load || a < b)
-		return 1;
-        return -1;
+static int sort_entry_less(struct irq_sort_entry *a, struct irq_sort_entry *b)
+{
+	if (a->key != b->key)
+		return a->key < b->key;
+	return a->irq < b->irq;
 }
 
-void sort_irq_list(GList **list)
+static void insertion_sort_entries(struct irq_sort_entry *e, unsigned int n)
 {
-	*list = g_list_sort(*list, sort_irqs);
+	struct irq_sort_entry tmp;
+	unsigned int i, j;
+
+	for (i = 1; i < n; i++) {
+		tmp = e[i];
+		for (j = i; j > 0 && sort_entry_less(&tmp, &e[j - 1]); j--)
+			e[j] = e[j - 1];
+		e[j] = tmp;
+	}
+}
+
+static uint8_t sort_digit(struct irq_sort_entry *e, int pass)
+{
+	if (pass < 4)
+		return (e->irq >> (pass * 8)) & 0xff;
+	return (e->key >> ((pass - 4) * 8)) & 0xff;
+}
+
+/*
+ * LSD radix sort, one byte per pass from the least significant byte of
+ * the irq number to the most significant byte of the key.  Passes where
+ * every entry has the same digit are skipped, which is most of them.
+ * Returns the buffer holding the sorted entries.
+ */
+static struct irq_sort_entry *radix_sort_entries(struct irq_sort_entry *src,
+						 struct irq_sort_entry *dst,
+						 unsigned int n)
+{
+	unsigned int count[256], pos, i, d;
+	struct irq_sort_entry *tmp;
+	int pass;
+
+	for (pass = 0; pass < 12; pass++) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[sort_digit(&src[i], pass)]++;
+		if (count[sort_digit(&src[0], pass)] == n)
+			continue;
+
+		for (pos = 0, d = 0; d < 256; d++) {
+			i = count[d];
+			count[d] = pos;
+			pos += i;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[sort_digit(&src[i], pass)]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	return src;
+}
+
+void sort_irq_list(struct irq_list *list)
+{
+	struct irq_sort_entry *e, *sorted;
+	struct irq_info *info, *prev = NULL;
+	unsigned int n = list->count, i;
+
+	if (n < 2)
+		return;
+
+	if (n * 2 > sort_buf_size) {
+		e = realloc(sort_buf, n * 2 * sizeof(struct irq_sort_entry));
+		if (!e)
+			return;
+		sort_buf = e;
+		sort_buf_size = n * 2;
+	}
+
+	e = sort_buf;
+	for (i = 0, info = list->head; info && i < n; info = info->next, i++)
+		set_sort_key(&e[i], info);
+	n = i;
+
+	if (n <= 16) {
+		insertion_sort_entries(e, n);
+		sorted = e;
+	} else
+		sorted = radix_sort_entries(e, e + n, n);
+
+	list->head = NULL;
+	for (i = 0; i < n; i++) {
+		info = sorted[i].info;
+		info->prev = prev;
+		if (prev)
+			prev->next = info;
+		else
+			list->head = info;
+		prev = info;
+	}
+	prev->next = NULL;
+	list->tail = prev;
 }
@@ -3,6 +3,14 @@
 
 // Maximum number of CPUs
 #define NR_CPUS 4096
+/*
+ * Number of bits of a cpumask that are actually in use on this machine.
+ * cpumask_t keeps room for NR_CPUS bits, but all of the operations below
+ * only look at the first nr_cpumask_bits, which is set at startup from
+ * the number of possible cpus (see set_cpumask_width()).
+ */
+extern int nr_cpumask_bits;
+
 /*
  * Cpumasks provide a bitmap suitable for representing the
  * set of CPU's in a system, one bit position per CPU number.
@@ -42,8 +50,8 @@
  * void cpus_shift_right(dst, src, n)	Shift right
  * void cpus_shift_left(dst, src, n)	Shift left
  *
- * int first_cpu(mask)			Number lowest set bit, or NR_CPUS
- * int next_cpu(cpu, mask)		Next cpu past 'cpu', or NR_CPUS
+ * int first_cpu(mask)			Number lowest set bit, or nr_cpumask_bits
+ * int next_cpu(cpu, mask)		Next cpu past 'cpu', or nr_cpumask_bits
  *
  * cpumask_t cpumask_of_cpu(cpu)	Return cpumask with bit 'cpu' set
  * CPU_MASK_ALL				Initializer - all bits set
@@ -100,13 +108,13 @@ static inline void __cpu_clear(int cpu, volatile cpumask_t *dstp)
 	clear_bit(cpu, dstp->bits);
 }
 
-#define cpus_setall(dst) __cpus_setall(&(dst), NR_CPUS)
+#define cpus_setall(dst) __cpus_setall(&(dst), nr_cpumask_bits)
 static inline void __cpus_setall(cpumask_t *dstp, int nbits)
 {
 	bitmap_fill(dstp->bits, nbits);
 }
 
-#define cpus_clear(dst) __cpus_clear(&(dst), NR_CPUS)
+#define cpus_clear(dst) __cpus_clear(&(dst), nr_cpumask_bits)
 static inline void __cpus_clear(cpumask_t *dstp, int nbits)
 {
 	bitmap_zero(dstp->bits, nbits);
@@ -115,21 +123,21 @@ static inline void __cpus_clear(cpumask_t *dstp, int nbits)
 /* No static inline type checking - see Subtlety (1) above. */
 #define cpu_isset(cpu, cpumask) test_bit((cpu), (cpumask).bits)
 
-#define cpus_and(dst, src1, src2) __cpus_and(&(dst), &(src1), &(src2), NR_CPUS)
+#define cpus_and(dst, src1, src2) __cpus_and(&(dst), &(src1), &(src2), nr_cpumask_bits)
 static inline void __cpus_and(cpumask_t *dstp, const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
 	bitmap_and(dstp->bits, src1p->bits, src2p->bits, nbits);
 }
 
-#define cpus_or(dst, src1, src2) __cpus_or(&(dst), &(src1), &(src2), NR_CPUS)
+#define cpus_or(dst, src1, src2) __cpus_or(&(dst), &(src1), &(src2), nr_cpumask_bits)
 static inline void __cpus_or(cpumask_t *dstp, const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
 	bitmap_or(dstp->bits, src1p->bits, src2p->bits, nbits);
 }
 
-#define cpus_xor(dst, src1, src2) __cpus_xor(&(dst), &(src1), &(src2), NR_CPUS)
+#define cpus_xor(dst, src1, src2) __cpus_xor(&(dst), &(src1), &(src2), nr_cpumask_bits)
 static inline void __cpus_xor(cpumask_t *dstp, const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
@@ -137,61 +145,61 @@ static inline void __cpus_xor(cpumask_t *dstp, const cpumask_t *src1p,
 }
 
 #define cpus_andnot(dst, src1, src2) \
-				__cpus_andnot(&(dst), &(src1), &(src2), NR_CPUS)
+				__cpus_andnot(&(dst), &(src1), &(src2), nr_cpumask_bits)
 static inline void __cpus_andnot(cpumask_t *dstp, const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
 	bitmap_andnot(dstp->bits, src1p->bits, src2p->bits, nbits);
 }
 
-#define cpus_complement(dst, src) __cpus_complement(&(dst), &(src), NR_CPUS)
+#define cpus_complement(dst, src) __cpus_complement(&(dst), &(src), nr_cpumask_bits)
 static inline void __cpus_complement(cpumask_t *dstp,
 					const cpumask_t *srcp, int nbits)
 {
 	bitmap_complement(dstp->bits, srcp->bits, nbits);
 }
 
-#define cpus_equal(src1, src2) __cpus_equal(&(src1), &(src2), NR_CPUS)
+#define cpus_equal(src1, src2) __cpus_equal(&(src1), &(src2), nr_cpumask_bits)
 static inline int __cpus_equal(const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
 	return bitmap_equal(src1p->bits, src2p->bits, nbits);
 }
 
-#define cpus_intersects(src1, src2) __cpus_intersects(&(src1), &(src2), NR_CPUS)
+#define cpus_intersects(src1, src2) __cpus_intersects(&(src1), &(src2), nr_cpumask_bits)
 static inline int __cpus_intersects(const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
 	return bitmap_intersects(src1p->bits, src2p->bits, nbits);
 }
 
-#define cpus_subset(src1, src2) __cpus_subset(&(src1), &(src2), NR_CPUS)
+#define cpus_subset(src1, src2) __cpus_subset(&(src1), &(src2), nr_cpumask_bits)
 static inline int __cpus_subset(const cpumask_t *src1p,
 					const cpumask_t *src2p, int nbits)
 {
 	return bitmap_subset(src1p->bits, src2p->bits, nbits);
 }
 
-#define cpus_empty(src) __cpus_empty(&(src), NR_CPUS)
+#define cpus_empty(src) __cpus_empty(&(src), nr_cpumask_bits)
 static inline int __cpus_empty(const cpumask_t *srcp, int nbits)
 {
 	return bitmap_empty(srcp->bits, nbits);
 }
 
-#define cpus_full(cpumask) __cpus_full(&(cpumask), NR_CPUS)
+#define cpus_full(cpumask) __cpus_full(&(cpumask), nr_cpumask_bits)
 static inline int __cpus_full(const cpumask_t *srcp, int nbits)
 {
 	return bitmap_full(srcp->bits, nbits);
 }
 
-#define cpus_weight(cpumask) __cpus_weight(&(cpumask), NR_CPUS)
+#define cpus_weight(cpumask) __cpus_weight(&(cpumask), nr_cpumask_bits)
 static inline int __cpus_weight(const cpumask_t *srcp, int nbits)
 {
 	return bitmap_weight(srcp->bits, nbits);
 }
 
 #define cpus_shift_right(dst, src, n) \
-			__cpus_shift_right(&(dst), &(src), (n), NR_CPUS)
+			__cpus_shift_right(&(dst), &(src), (n), nr_cpumask_bits)
 static inline void __cpus_shift_right(cpumask_t *dstp,
 					const cpumask_t *srcp, int n, int nbits)
 {
@@ -199,7 +207,7 @@ static inline void __cpus_shift_right(cpumask_t *dstp,
 }
 
 #define cpus_shift_left(dst, src, n) \
-			__cpus_shift_left(&(dst), &(src), (n), NR_CPUS)
+			__cpus_shift_left(&(dst), &(src), (n), nr_cpumask_bits)
 static inline void __cpus_shift_left(cpumask_t *dstp,
 					const cpumask_t *srcp, int n, int nbits)
 {
@@ -208,11 +216,14 @@ static inline void __cpus_shift_left(cpumask_t *dstp,
 
 static inline int __first_cpu(const cpumask_t *srcp)
 {
-        return ffs(*srcp->bits)-1;
+	return find_first_bit(srcp->bits, nr_cpumask_bits);
 }
 
 #define first_cpu(src) __first_cpu(&(src))
-int __next_cpu(int n, const cpumask_t *srcp);
+static inline int __next_cpu(int n, const cpumask_t *srcp)
+{
+	return find_next_bit(srcp->bits, nr_cpumask_bits, n + 1);
+}
 #define next_cpu(n, src) __next_cpu((n), &(src))
 
 #define cpumask_of_cpu(cpu)						\
@@ -259,7 +270,7 @@ int __next_cpu(int n, const cpumask_t *srcp);
 #define cpus_addr(src) ((src).bits)
 
 #define cpumask_scnprintf(buf, len, src) \
-			__cpumask_scnprintf((buf), (len), &(src), NR_CPUS)
+			__cpumask_scnprintf((buf), (len), &(src), nr_cpumask_bits)
 static inline int __cpumask_scnprintf(char *buf, int len,
 					const cpumask_t *srcp, int nbits)
 {
@@ -267,7 +278,7 @@ static inline int __cpumask_scnprintf(char *buf, int len,
 }
 
 #define cpumask_parse_user(ubuf, ulen, dst) \
-			__cpumask_parse_user((ubuf), (ulen), &(dst), NR_CPUS)
+			__cpumask_parse_user((ubuf), (ulen), &(dst), nr_cpumask_bits)
 static inline int __cpumask_parse_user(const char  *buf, int len,
 					cpumask_t *dstp, int nbits)
 {
@@ -275,21 +286,21 @@ static inline int __cpumask_parse_user(const char  *buf, int len,
 }
 
 #define cpulist_scnprintf(buf, len, src) \
-			__cpulist_scnprintf((buf), (len), &(src), NR_CPUS)
+			__cpulist_scnprintf((buf), (len), &(src), nr_cpumask_bits)
 static inline int __cpulist_scnprintf(char *buf, int len,
 					const cpumask_t *srcp, int nbits)
 {
 	return bitmap_scnlistprintf(buf, len, srcp->bits, nbits);
 }
 
-#define cpulist_parse(buf, dst) __cpulist_parse((buf), &(dst), NR_CPUS)
+#define cpulist_parse(buf, dst) __cpulist_parse((buf), &(dst), nr_cpumask_bits)
 static inline int __cpulist_parse(const char *buf, cpumask_t *dstp, int nbits)
 {
 	return bitmap_parselist(buf, dstp->bits, nbits);
 }
 
 #define cpu_remap(oldbit, old, new) \
-		__cpu_remap((oldbit), &(old), &(new), NR_CPUS)
+		__cpu_remap((oldbit), &(old), &(new), nr_cpumask_bits)
 static inline int __cpu_remap(int oldbit,
 		const cpumask_t *oldp, const cpumask_t *newp, int nbits)
 {
@@ -297,7 +308,7 @@ static inline int __cpu_remap(int oldbit,
 }
 
 #define cpus_remap(dst, src, old, new) \
-		__cpus_remap(&(dst), &(src), &(old), &(new), NR_CPUS)
+		__cpus_remap(&(dst), &(src), &(old), &(new), nr_cpumask_bits)
 static inline void __cpus_remap(cpumask_t *dstp, const cpumask_t *srcp,
 		const cpumask_t *oldp, const cpumask_t *newp, int nbits)
 {
@@ -307,7 +318,7 @@ static inline void __cpus_remap(cpumask_t *dstp, const cpumask_t *srcp,
 #if NR_CPUS > 1
 #define for_each_cpu_mask(cpu, mask)		\
 	for ((cpu) = first_cpu(mask);		\
-		(cpu) < NR_CPUS;		\
+		(cpu) < nr_cpumask_bits;	\
 		(cpu) = next_cpu((cpu), (mask)))
 #else /* NR_CPUS == 1 */
 #define for_each_cpu_mask(cpu, mask)		\
@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <ctype.h>
 
 #include <glib.h>
 
@@ -47,11 +48,29 @@ int package_count;
 int cache_domain_count;
 int core_count;
 
+/*
+ * Dense index of the cpus list, addressed by cpu number.  Banned and
+ * offline cpus have an empty entry.
+ */
+struct cpu_topo *cpu_topo_index;
+int cpu_topo_index_size;
+static int cpu_topo_count;
+
+/*
+ * Each level of the tree is allocated from its own pool, so that objects
+ * walked together stay together, and a rescan can drop the whole tree at once
+ */
+static struct obj_pool package_pool = OBJ_POOL_INIT(struct topo_obj, 16);
+static struct obj_pool cache_domain_pool = OBJ_POOL_INIT(struct topo_obj, 64);
+static struct obj_pool cpu_pool = OBJ_POOL_INIT(struct topo_obj, 256);
+
 /* Users want to be able to keep interrupts away from some cpus; store these in a cpumask_t */
 cpumask_t banned_cpus;
 
 cpumask_t cpu_possible_map;
 
+int nr_cpumask_bits = NR_CPUS;
+
 /*
    it's convenient to have the complement of banned_cpus available so that
    the AND operator can be used to mask out unwanted cpus
@@ -60,7 +79,7 @@ cpumask_t unbanned_cpus;
 
 // 将 cache_domain 结构加入到指定的 package 结构中，如果不存在 packageid 的 package结构，则在 package 结构 list 队尾增加一个 packageid 的 package 结构，并将 cache_domain 结构插入
 static struct topo_obj* add_cache_domain_to_package(struct topo_obj *cache,
-						    int packageid, cpumask_t package_mask)
+						    int packageid, cpumask_id_t package_mask)
 {
 	GList *entry;
 	struct topo_obj *package;
@@ -70,7 +89,7 @@ static struct topo_obj* add_cache_domain_to_package(struct topo_obj *cache,
 
 	while (entry) {
 		package = entry->data;
-		if (cpus_equal(package_mask, package->mask)) {
+		if (package_mask == package->mask) {
 			if (packageid != package->number)
 				log(TO_ALL, LOG_WARNING, "package_mask with different physical_package_id found!\n");
 			break;
@@ -79,12 +98,13 @@ static struct topo_obj* add_cache_domain_to_package(struct topo_obj *cache,
 	}
 
 	if (!entry) {
-		package = calloc(sizeof(struct topo_obj), 1);
+		package = pool_alloc(&package_pool);
 		if (!package)
 			return NULL;
 		package->mask = package_mask;
 		package->obj_type = OBJ_TYPE_PACKAGE;
 		package->obj_type_list = &packages;
+		package->obj_type_count = &package_count;
 		package->number = packageid;
 		packages = g_list_append(packages, package);
 		package_count++;
@@ -100,6 +120,7 @@ static struct topo_obj* add_cache_domain_to_package(struct topo_obj *cache,
 
 	if (!entry) {
 		package->children = g_list_append(package->children, cache);
+		package->num_children++;
 		cache->parent = package;
 	}
 
@@ -108,7 +129,7 @@ static struct topo_obj* add_cache_domain_to_package(struct topo_obj *cache,
 // 将 cpu 结构加入到指定的 cache结构中，如果指定 cache结构不存在，则在 cache结构 list 队尾增加一个指定的 cache结构，并将 cpu 结构插入
 // 这里传入的 cache_mask 为 L3 缓存共享 cpu map
 static struct topo_obj* add_cpu_to_cache_domain(struct topo_obj *cpu,
-						    cpumask_t cache_mask)
+						    cpumask_id_t cache_mask)
 {
 	GList *entry;
 	struct topo_obj *cache;
@@ -118,19 +139,20 @@ static struct topo_obj* add_cpu_to_cache_domain(struct topo_obj *cpu,
 
 	while (entry) { // 遍历 cache_domains list
 		cache = entry->data;
-		if (cpus_equal(cache_mask, cache->mask))
+		if (cache_mask == cache->mask)
 			break;
 		entry = g_list_next(entry);
 	}
 
 	if (!entry) {  // cache_mask 不在已有的 cache_domains 列表中
-		cache = calloc(sizeof(struct topo_obj), 1);
+		cache = pool_alloc(&cache_domain_pool);
 		if (!cache)
 			return NULL;
 		cache->obj_type = OBJ_TYPE_CACHE;
 		cache->mask = cache_mask;
 		cache->number = cache_domain_count;
 		cache->obj_type_list = &cache_domains;
+		cache->obj_type_count = &cache_domain_count;
 		cache_domains = g_list_append(cache_domains, cache);
 		cache_domain_count++;
 	}
@@ -145,50 +167,83 @@ static struct topo_obj* add_cpu_to_cache_domain(struct topo_obj *cpu,
 
 	if (!entry) {
 		cache->children = g_list_append(cache->children, cpu);
+		cache->num_children++;
 		cpu->parent = (struct topo_obj *)cache;
 	}
 
 	return cache;
 }
 
-static void do_one_cpu(char *path)  // path = "/sys/devices/system/cpu/cpu0" 等
+static struct cpu_topo *get_cpu_topo_entry(int cpunr)
+{
+	struct cpu_topo *new_index;
+	int new_size;
+
+	if (cpunr < 0)
+		return NULL;
+
+	if (cpunr >= cpu_topo_index_size) {
+		new_size = cpu_topo_index_size ? cpu_topo_index_size : 64;
+		while (new_size <= cpunr)
+			new_size *= 2;
+		new_index = realloc(cpu_topo_index, new_size * sizeof(struct cpu_topo));
+		if (!new_index)
+			return NULL;
+		memset(&new_index[cpu_topo_index_size], 0,
+		       (new_size - cpu_topo_index_size) * sizeof(struct cpu_topo));
+		cpu_topo_index = new_index;
+		cpu_topo_index_size = new_size;
+	}
+
+	return &cpu_topo_index[cpunr];
+}
+
+static void do_one_cpu(int cpudirfd, const char *name)  // name = "cpu0" 等, 在 /sys/devices/system/cpu 下
 {
 	struct topo_obj *cpu;
-	FILE *file;
+	struct cpu_topo *cpu_entry;
 	char new_path[PATH_MAX];
-	cpumask_t cache_mask, package_mask;
+	char buf[SYSFS_ATTR_MAX];
+	ssize_t len;
+	cpumask_t cpu_mask, cache_mask, package_mask;
 	struct topo_obj *cache;
 	struct topo_obj *package;
-	DIR *dir;
-	struct dirent *entry;
+	int cpufd, cachefd;
 	int nodeid;
 	int packageid = 0;
 	unsigned int max_cache_index, cache_index, cache_stat;
 
+	cpufd = sysfs_open_dir(cpudirfd, name);
+	if (cpufd < 0)
+		return;
+
 	/* skip offline cpus */
-	snprintf(new_path, PATH_MAX, "%s/online", path); // /sys/devices/system/cpu/cpu#/online, # 表示 cpu 编号
-	file = fopen(new_path, "r");
-	if (file) {
-		char *line = NULL;
-		size_t size = 0;
-		if (getline(&line, &size, file)==0)
-			return;
-		fclose(file);
-		if (line && line[0]=='0') {  // offline 的 cpu 该文件内容为 0
-			free(line);
-			return;                  // 忽略掉下线的 cpu
-		}
-		free(line);
-	}
+	len = sysfs_read_attr(cpufd, "online", buf, sizeof(buf)); // /sys/devices/system/cpu/cpu#/online, # 表示 cpu 编号
+	if (len == 0)
+		goto out;
+	if (len > 0 && buf[0] == '0')  // offline 的 cpu 该文件内容为 0
+		goto out;                  // 忽略掉下线的 cpu
 
-	cpu = calloc(sizeof(struct topo_obj), 1);
+	cpu = pool_alloc(&cpu_pool);
 	if (!cpu)
-		return;
+		goto out;
 
 	cpu->obj_type = OBJ_TYPE_CPU;
-	cpu->number = strtoul(&path[27], NULL, 10); // 从路径截取 cpu 编号，转换成 10 进制，这个也可以从 topology/core_id 文件获取
+	cpu->number = strtoul(&name[3], NULL, 10); // 从目录名截取 cpu 编号，转换成 10 进制，这个也可以从 topology/core_id 文件获取
+	if (cpu->number >= nr_cpumask_bits) {
+		log(TO_ALL, LOG_WARNING, "cpu %d is beyond the possible cpu range, ignoring\n", cpu->number);
+		pool_free(&cpu_pool, cpu);
+		goto out;
+	}
+	cpu_entry = get_cpu_topo_entry(cpu->number);
+	if (!cpu_entry) {
+		pool_free(&cpu_pool, cpu);
+		goto out;
+	}
 	cpu_set(cpu->number, cpu_possible_map);    // 根据 cpu 编号设置 bitmap
-	cpu_set(cpu->number, cpu->mask);
+	cpus_clear(cpu_mask);
+	cpu_set(cpu->number, cpu_mask);
+	cpu->mask = intern_cpumask(&cpu_mask);
 
 	/*
  	 * Default the cache_domain mask to be equal to the cpu
@@ -197,85 +252,57 @@ static void do_one_cpu(char *path)  // path = "/sys/devices/system/cpu/cpu0" 等
 	cpu_set(cpu->number, cache_mask);
 
 	// 如果当前 cpu 编号被 cpu 黑名单，那么就不添加它
-	if (cpus_intersects(cpu->mask, banned_cpus)) { // 两者相与，如果存在都为1的位,返回1,不存在返回0
-		free(cpu);
+	if (cpus_intersects(cpu_mask, banned_cpus)) { // 两者相与，如果存在都为1的位,返回1,不存在返回0
+		pool_free(&cpu_pool, cpu);
 		/* even though we don't use the cpu we do need to count it */
 		core_count++;
-		return;
+		goto out;
 	}
 
 
 	/* try to read the package mask; if it doesn't exist assume solitary */
 
 	// core_siblings：在同一个物理 package 下 cpu#'s 硬件线程的内部 kernel map
-	snprintf(new_path, PATH_MAX, "%s/topology/core_siblings", path); // /sys/devices/system/cpu/cpu#/topology/core_siblings
-	file = fopen(new_path, "r");
 	cpu_set(cpu->number, package_mask);
-	if (file) {
-		char *line = NULL;
-		size_t size = 0;
-		if (getline(&line, &size, file))
-			cpumask_parse_user(line, strlen(line), package_mask); // 将 bitmap package_mask 表示的值转换成字符串 line
-		fclose(file);
-		free(line);
-	}
+	len = sysfs_read_attr(cpufd, "topology/core_siblings", buf, sizeof(buf));
+	if (len > 0)
+		cpumask_parse_user(buf, len, package_mask);
 	/* try to read the package id */
-	snprintf(new_path, PATH_MAX, "%s/topology/physical_package_id", path);
-	file = fopen(new_path, "r");
-	if (file) {
-		char *line = NULL;
-		size_t size = 0;
-		if (getline(&line, &size, file))
-			packageid = strtoul(line, NULL, 10);
-		fclose(file);
-		free(line);
-	}
+	sysfs_read_int(cpufd, "topology/physical_package_id", 10, &packageid);
 
 	/* try to read the cache mask; if it doesn't exist assume solitary */
 	/* We want the deepest cache level available */
 	cpu_set(cpu->number, cache_mask);
 	max_cache_index = 0;
 	cache_index = 1;
-	cache_stat = 0;
-	do {
-		struct stat sb;
-		snprintf(new_path, PATH_MAX, "%s/cache/index%d/shared_cpu_map", path, cache_index); // 与该 cpu 共享这一级缓存的 cpu 编号表，二进制字符串，如 0000,01000001
-		cache_stat = stat(new_path, &sb);
+	cachefd = sysfs_open_dir(cpufd, "cache");
+	cache_stat = cachefd < 0;
+	while (!cache_stat) { // 遍历 L1 ~ L3 级缓存
+		// 与该 cpu 共享这一级缓存的 cpu 编号表，二进制字符串，如 0000,01000001
+		snprintf(new_path, PATH_MAX, "index%d/shared_cpu_map", cache_index);
+		cache_stat = faccessat(cachefd, new_path, F_OK, 0);
 		if (!cache_stat) {
 			max_cache_index = cache_index;
 			if (max_cache_index == deepest_cache)
 				break;
 			cache_index ++;
 		}
-	} while(!cache_stat); // 遍历 L1 ~ L3 级缓存
+	}
 
 	if (max_cache_index > 0) {
-		snprintf(new_path, PATH_MAX, "%s/cache/index%d/shared_cpu_map", path, max_cache_index); // L3 级别缓存
-		file = fopen(new_path, "r");
-		if (file) {
-			char *line = NULL;
-			size_t size = 0;
-			if (getline(&line, &size, file))
-				cpumask_parse_user(line, strlen(line), cache_mask); // L3 存在于物理核中， 被多个 core 共享
-			fclose(file);
-			free(line);
-		}
+		snprintf(new_path, PATH_MAX, "index%d/shared_cpu_map", max_cache_index); // L3 级别缓存
+		len = sysfs_read_attr(cachefd, new_path, buf, sizeof(buf));
+		if (len > 0)
+			cpumask_parse_user(buf, len, cache_mask); // L3 存在于物理核中， 被多个 core 共享
 	}
+	if (cachefd >= 0)
+		close(cachefd);
 
-	nodeid=-1;
-	if (numa_avail) {
-		dir = opendir(path);
-		do {
-			entry = readdir(dir);
-			if (!entry)
-				break;
-			if (strstr(entry->d_name, "node")) {
-				nodeid = strtoul(&entry->d_name[4], NULL, 10); // 获得 nodeid，从目录截取
-				break;
-			}
-		} while (entry);
-		closedir(dir);
-	}
+	/*
+	 * The cpu's nodeN link matches the cpumap of node N, which we already
+	 * read while building the numa node list
+	 */
+	nodeid = numa_avail ? cpu_numa_node_id(cpu->number) : -1;
 
 	/*
 	   blank out the banned cpus from the various masks so that interrupts
@@ -286,13 +313,22 @@ static void do_one_cpu(char *path)  // path = "/sys/devices/system/cpu/cpu0" 等
 	cpus_and(package_mask, package_mask, unbanned_cpus);
 
     // 以下三个函数构建起基本架构，设置 parent 和 children
-	cache = add_cpu_to_cache_domain(cpu, cache_mask);
-	package = add_cache_domain_to_package(cache, packageid, package_mask);
+	cache = add_cpu_to_cache_domain(cpu, intern_cpumask(&cache_mask));
+	package = add_cache_domain_to_package(cache, packageid, intern_cpumask(&package_mask));
 	add_package_to_node(package, nodeid);
 
+	cpu_entry->cpu = cpu;
+	cpu_entry->cache_domain = cache;
+	cpu_entry->package = package;
+	cpu_entry->numa_node = package_numa_node(package);
+
 	cpu->obj_type_list = &cpus;
+	cpu->obj_type_count = &cpu_topo_count;
 	cpus = g_list_append(cpus, cpu);
+	cpu_topo_count++;
 	core_count++;
+out:
+	close(cpufd);
 }
 
 static void dump_irq(struct irq_info *info, void *data)
@@ -301,7 +337,7 @@ static void dump_irq(struct irq_info *info, void *data)
 	int i;
 	for (i=0; i<spaces; i++) log(TO_CONSOLE, LOG_INFO, " ");
 	log(TO_CONSOLE, LOG_INFO, "Interrupt %i node_num is %d (%s/%u) \n",
-	    info->irq, irq_numa_node(info)->number, classes[info->class], (unsigned int)info->load);
+	    info->irq, irq_numa_node(info)->number, classes[info->class], (unsigned int)irq_load(info));
 }
 
 static void dump_topo_obj(struct topo_obj *d, void *data __attribute__((unused)))
@@ -309,32 +345,32 @@ static void dump_topo_obj(struct topo_obj *d, void *data __attribute__((unused))
 	struct topo_obj *c = (struct topo_obj *)d;
 	log(TO_CONSOLE, LOG_INFO, "                CPU number %i  numa_node is %d (load %lu)\n",
 	    c->number, cpu_numa_node(c)->number , (unsigned long)c->load);
-	if (c->interrupts)
-		for_each_irq(c->interrupts, dump_irq, (void *)18);
+	if (c->interrupts.head)
+		for_each_irq(&c->interrupts, dump_irq, (void *)18);
 }
 
 static void dump_cache_domain(struct topo_obj *d, void *data)
 {
 	char *buffer = data;
-	cpumask_scnprintf(buffer, 4095, d->mask);
+	cpumask_scnprintf(buffer, 4095, *cpumask_of_id(d->mask));
 	log(TO_CONSOLE, LOG_INFO, "        Cache domain %i:  numa_node is %d cpu mask is %s  (load %lu) \n",
 	    d->number, cache_domain_numa_node(d)->number, buffer, (unsigned long)d->load);
 	if (d->children)
 		for_each_object(d->children, dump_topo_obj, NULL);
-	if (g_list_length(d->interrupts) > 0)
-		for_each_irq(d->interrupts, dump_irq, (void *)10);
+	if (d->interrupts.head)
+		for_each_irq(&d->interrupts, dump_irq, (void *)10);
 }
 
 static void dump_package(struct topo_obj *d, void *data)
 {
 	char *buffer = data;
-	cpumask_scnprintf(buffer, 4096, d->mask);
+	cpumask_scnprintf(buffer, 4096, *cpumask_of_id(d->mask));
 	log(TO_CONSOLE, LOG_INFO, "Package %i:  numa_node is %d cpu mask is %s (load %lu)\n",
 	    d->number, package_numa_node(d)->number, buffer, (unsigned long)d->load);
 	if (d->children)
 		for_each_object(d->children, dump_cache_domain, buffer);
-	if (g_list_length(d->interrupts) > 0)
-		for_each_irq(d->interrupts, dump_irq, (void *)2);
+	if (d->interrupts.head)
+		for_each_irq(&d->interrupts, dump_irq, (void *)2);
 }
 
 void dump_tree(void)
@@ -343,16 +379,6 @@ void dump_tree(void)
 	for_each_object(packages, dump_package, buffer);
 }
 
-static void clear_irq_stats(struct irq_info *info, void *data __attribute__((unused)))
-{
-	info->load = 0;
-}
-
-static void clear_obj_stats(struct topo_obj *d, void *data __attribute__((unused)))
-{
-	for_each_object(d->children, clear_obj_stats, NULL);
-	for_each_irq(d->interrupts, clear_irq_stats, NULL);
-}
 
 /*
  * this function removes previous state from the cpu tree, such as
@@ -361,7 +387,52 @@ static void clear_obj_stats(struct topo_obj *d, void *data __attribute__((unused
  */
 void clear_work_stats(void)
 {
-	for_each_object(numa_nodes, clear_obj_stats, NULL);
+	if (irq_counters.count)
+		memset(irq_counters.load, 0, irq_counters.count * sizeof(uint64_t));
+}
+
+/*
+ * Size cpumask operations to the machine: the highest possible cpu number
+ * plus one, so that mask walks only touch the words that can have bits set.
+ */
+void set_cpumask_width(void)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	char *c, *end;
+	long cpu, max_cpu = -1;
+
+	file = fopen("/sys/devices/system/cpu/possible", "r");
+	if (file) {
+		if (getline(&line, &size, file) > 0) {
+			/* the file is a cpulist such as 0-95 or 0-3,8-11 */
+			c = line;
+			while (*c) {
+				if (!isdigit(*c)) {
+					c++;
+					continue;
+				}
+				cpu = strtol(c, &end, 10);
+				if (cpu > max_cpu)
+					max_cpu = cpu;
+				c = end;
+			}
+		}
+		fclose(file);
+		free(line);
+	}
+
+	if (max_cpu < 0)
+		max_cpu = sysconf(_SC_NPROCESSORS_CONF) - 1;
+
+	if (max_cpu < 0 || max_cpu >= NR_CPUS) {
+		log(TO_CONSOLE, LOG_INFO, "Unable to size cpumasks, using %d cpus\n", NR_CPUS);
+		nr_cpumask_bits = NR_CPUS;
+		return;
+	}
+
+	nr_cpumask_bits = max_cpu + 1;
 }
 
 // 遍历系统所有 cpu, 数据来源 /sys/devices/system/cpu/cpu#
@@ -385,9 +456,7 @@ void parse_cpu_tree(void)
 		if (entry &&
 		    sscanf(entry->d_name, "cpu%d%c", &num, &pad) == 1 &&
 		    !strchr(entry->d_name, ' ')) {
-			char new_path[PATH_MAX];
-			sprintf(new_path, "/sys/devices/system/cpu/%s", entry->d_name); // entry->d_name 为 cpu 序号
-			do_one_cpu(new_path);
+			do_one_cpu(dirfd(dir), entry->d_name); // entry->d_name 为 cpu 序号
 		}
 	} while (entry);
 	closedir(dir);
@@ -404,62 +473,47 @@ void parse_cpu_tree(void)
 void clear_cpu_tree(void)
 {
 	GList *item;
-	struct topo_obj *cpu;
-	struct topo_obj *cache_domain;
-	struct topo_obj *package;
+	struct topo_obj *obj;
 
-	while (packages) {
-		item = g_list_first(packages);
-		package = item->data;
-		g_list_free(package->children);
-		g_list_free(package->interrupts);
-		free(package);
-		packages = g_list_delete_link(packages, item);
+	for (item = packages; item; item = g_list_next(item)) {
+		obj = item->data;
+		g_list_free(obj->children);
 	}
+	g_list_free(packages);
+	packages = NULL;
 	package_count = 0;
 
-	while (cache_domains) {
-		item = g_list_first(cache_domains);
-		cache_domain = item->data;
-		g_list_free(cache_domain->children);
-		g_list_free(cache_domain->interrupts);
-		free(cache_domain);
-		cache_domains = g_list_delete_link(cache_domains, item);
+	for (item = cache_domains; item; item = g_list_next(item)) {
+		obj = item->data;
+		g_list_free(obj->children);
 	}
+	g_list_free(cache_domains);
+	cache_domains = NULL;
 	cache_domain_count = 0;
 
-
-	while (cpus) {
-		item = g_list_first(cpus);
-		cpu = item->data;
-		g_list_free(cpu->interrupts);
-		free(cpu);
-		cpus = g_list_delete_link(cpus, item);
-	}
+	g_list_free(cpus);
+	cpus = NULL;
 	core_count = 0;
 
-}
+	pool_reset(&package_pool);
+	pool_reset(&cache_domain_pool);
+	pool_reset(&cpu_pool);
 
-static gint compare_cpus(gconstpointer a, gconstpointer b)
-{
-	const struct topo_obj *ai = a;
-	const struct topo_obj *bi = b;
+	if (cpu_topo_index)
+		memset(cpu_topo_index, 0, cpu_topo_index_size * sizeof(struct cpu_topo));
+	cpu_topo_count = 0;
 
-	return ai->number - bi->number;
 }
 
 struct topo_obj *find_cpu_core(int cpunr)
 {
-	GList *entry;
-	struct topo_obj find;
-
-	find.number = cpunr;
-	entry = g_list_find_custom(cpus, &find, compare_cpus);
+	if (cpunr < 0 || cpunr >= cpu_topo_index_size)
+		return NULL;
 
-	return entry ? entry->data : NULL;
+	return cpu_topo_index[cpunr].cpu;
 }
 
 int get_cpu_count(void)
 {
-	return g_list_length(cpus);
+	return cpu_topo_count;
 }
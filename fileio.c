@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2012, Neil Horman <nhorman@tuxdriver.com>
+ *
+ * This file is part of irqbalance
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Readers for the files we sample every cycle.  Each one keeps its file
+ * descriptor open and its buffer allocated for the life of the daemon, and
+ * re-reads the whole file from offset 0 on every call.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "irqbalance.h"
+
+#define PROC_FILE_MIN_BUF 16384
+
+static int proc_file_open(struct proc_file *f)
+{
+	f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+	if (f->fd < 0)
+		return -1;
+	f->no_pread = 0;
+	return 0;
+}
+
+void proc_file_close(struct proc_file *f)
+{
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+}
+
+static ssize_t proc_file_read_at(struct proc_file *f, size_t off)
+{
+	ssize_t ret;
+
+	if (!f->no_pread) {
+		ret = pread(f->fd, f->buf + off, f->size - off - 1, off);
+		if (ret >= 0 || errno != ESPIPE)
+			return ret;
+		f->no_pread = 1;
+		if (lseek(f->fd, off, SEEK_SET) < 0)
+			return -1;
+	}
+
+	return read(f->fd, f->buf + off, f->size - off - 1);
+}
+
+/*
+ * Read the file from off to its end, behind whatever is already in the
+ * buffer up to off
+ */
+static int proc_file_fill(struct proc_file *f, size_t off)
+{
+	char *new_buf;
+	ssize_t ret;
+
+	if (f->no_pread && lseek(f->fd, off, SEEK_SET) < 0)
+		return -1;
+
+	f->len = off;
+	for (;;) {
+		if (f->len + 1 >= f->size) {
+			new_buf = realloc(f->buf, f->size * 2);
+			if (!new_buf)
+				return -1;
+			f->buf = new_buf;
+			f->size *= 2;
+		}
+		ret = proc_file_read_at(f, f->len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		f->len += ret;
+	}
+	f->buf[f->len] = 0;
+	return 0;
+}
+
+/*
+ * Read the whole file into f's buffer and return it, NUL terminated.
+ * The contents stay valid until the next call for the same file.  Returns
+ * NULL if the file can't be read, in which case the descriptor is
+ * dropped and reopened on the next call.
+ */
+char *proc_file_read(struct proc_file *f)
+{
+	size_t off = 0;
+
+	/* a prefetch only has the start of the file, read on to its end */
+	if (f->prefetched) {
+		f->prefetched = 0;
+		off = f->len;
+	}
+
+	if (!f->buf) {
+		f->buf = malloc(PROC_FILE_MIN_BUF);
+		if (!f->buf)
+			return NULL;
+		f->size = PROC_FILE_MIN_BUF;
+	}
+
+	if (f->fd < 0 && proc_file_open(f))
+		return NULL;
+
+	if (proc_file_fill(f, off)) {
+		proc_file_close(f);
+		return NULL;
+	}
+
+	return f->buf;
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * With io_uring the reads and writes of a cycle are queued up and handed
+ * to the kernel together, rather than costing a few syscalls each.  If the
+ * ring can't be set up we quietly use the plain syscalls.
+ */
+#define IO_RING_ENTRIES 256
+
+static struct io_uring ring;
+static int ring_state;		/* 0 not set up yet, 1 ready, -1 unavailable */
+
+static int io_ring_ready(void)
+{
+	if (!ring_state) {
+		if (io_uring_queue_init(IO_RING_ENTRIES, &ring, 0)) {
+			log(TO_CONSOLE, LOG_INFO, "io_uring unavailable, using plain file I/O\n");
+			ring_state = -1;
+		} else
+			ring_state = 1;
+	}
+	return ring_state > 0;
+}
+
+/*
+ * Give up on the ring for good.  The requests still in flight are waited
+ * for a little, so that the files their opens return are known to be
+ * closed again, before the ring goes.
+ */
+static void io_ring_drop(int in_flight, void (*done)(void *data, int res))
+{
+	struct __kernel_timespec ts = { .tv_sec = 1 };
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	while (in_flight) {
+		ret = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		done(io_uring_cqe_get_data(cqe), cqe->res);
+		io_uring_cqe_seen(&ring, cqe);
+		in_flight--;
+	}
+
+	io_uring_queue_exit(&ring);
+	ring_state = -1;
+}
+
+/*
+ * Submit the count queued requests and hand each completion to done.  A
+ * ring that fails us is dropped for good, and -1 returned.
+ */
+static int io_ring_wait(int count, void (*done)(void *data, int res))
+{
+	struct io_uring_cqe *cqe;
+	int submitted, ret;
+
+	if (!count)
+		return 0;
+
+	do {
+		ret = io_uring_submit(&ring);
+	} while (ret == -EINTR);
+	submitted = ret > 0 ? ret : 0;
+	if (ret < count)
+		goto fail;
+
+	while (submitted) {
+		ret = io_uring_wait_cqe(&ring, &cqe);
+		/* SIGHUP and SIGINT don't restart system calls */
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			goto fail;
+		done(io_uring_cqe_get_data(cqe), cqe->res);
+		io_uring_cqe_seen(&ring, cqe);
+		submitted--;
+	}
+	return 0;
+
+fail:
+	log(TO_ALL, LOG_WARNING, "io_uring failed (%d), using plain file I/O\n", ret);
+	io_ring_drop(submitted, done);
+	return -1;
+}
+
+static void io_open_done(void *data, int res)
+{
+	struct io_op *op = data;
+
+	if (res < 0) {
+		op->result = res;
+		op->done = 1;
+		return;
+	}
+	op->fd = res;
+	op->opened = 1;
+}
+
+static void io_rw_done(void *data, int res)
+{
+	struct io_op *op = data;
+
+	op->result = res;
+	op->done = 1;
+	if (!op->write)
+		op->buf[res > 0 ? res : 0] = 0;
+}
+
+static void io_close_done(void *data, int res __attribute__((unused)))
+{
+	struct io_op *op = data;
+
+	op->fd = -1;
+}
+
+/*
+ * Open, read or write, and close the files of a batch through the ring.
+ * Ops it doesn't get to finish are left with done unset.
+ */
+static void io_ring_batch(struct io_op *ops, int count)
+{
+	struct io_uring_sqe *sqe;
+	struct io_op *op;
+	int queued, i;
+
+	for (queued = i = 0; i < count; i++) {
+		op = &ops[i];
+		sqe = io_uring_get_sqe(&ring);
+		if (!sqe)
+			break;
+		io_uring_prep_openat(sqe, AT_FDCWD, op->path,
+				     (op->write ? O_WRONLY | O_TRUNC : O_RDONLY) | O_CLOEXEC, 0);
+		io_uring_sqe_set_data(sqe, op);
+		queued++;
+	}
+	if (io_ring_wait(queued, io_open_done))
+		goto out;
+
+	for (queued = i = 0; i < count; i++) {
+		op = &ops[i];
+		if (op->fd < 0)
+			continue;
+		sqe = io_uring_get_sqe(&ring);
+		if (!sqe)
+			break;
+		if (op->write)
+			io_uring_prep_write(sqe, op->fd, op->buf, op->len, 0);
+		else
+			io_uring_prep_read(sqe, op->fd, op->buf, op->len - 1, 0);
+		io_uring_sqe_set_data(sqe, op);
+		queued++;
+	}
+	if (io_ring_wait(queued, io_rw_done))
+		goto out;
+
+	for (queued = i = 0; i < count; i++) {
+		op = &ops[i];
+		if (op->fd < 0)
+			continue;
+		sqe = io_uring_get_sqe(&ring);
+		if (!sqe)
+			break;
+		io_uring_prep_close(sqe, op->fd);
+		io_uring_sqe_set_data(sqe, op);
+		queued++;
+	}
+	io_ring_wait(queued, io_close_done);
+
+out:
+	/* whatever the ring didn't get to close */
+	for (i = 0; i < count; i++) {
+		if (ops[i].fd >= 0)
+			close(ops[i].fd);
+		ops[i].fd = -1;
+	}
+}
+
+static void prefetch_done(void *data, int res)
+{
+	struct proc_file *f = data;
+
+	/*
+	 * procfs files are seq_files, a read returns at most a page or so
+	 * of them however much was asked for.  Whatever came back is kept
+	 * as the start of the file.
+	 */
+	if (res < 0)
+		return;
+	f->len = res;
+	f->prefetched = 1;
+}
+#endif
+
+/*
+ * Read a set of the files we sample every cycle in one go, ahead of the
+ * proc_file_read() calls that pick up their contents.  Only does anything
+ * with io_uring, and the rest of a file the ring only read part of is read
+ * as usual.
+ */
+void proc_file_prefetch(struct proc_file **files, int count)
+{
+#ifdef HAVE_LIBURING
+	struct io_uring_sqe *sqe;
+	struct proc_file *f;
+	int queued, i;
+
+	if (!io_ring_ready())
+		return;
+
+	for (queued = i = 0; i < count && i < IO_RING_ENTRIES; i++) {
+		f = files[i];
+		f->prefetched = 0;
+		if (!f->buf) {
+			f->buf = malloc(PROC_FILE_MIN_BUF);
+			if (!f->buf)
+				continue;
+			f->size = PROC_FILE_MIN_BUF;
+		}
+		if (f->fd < 0 && proc_file_open(f))
+			continue;
+		if (f->no_pread)
+			continue;
+		sqe = io_uring_get_sqe(&ring);
+		if (!sqe)
+			break;
+		io_uring_prep_read(sqe, f->fd, f->buf, f->size - 1, 0);
+		io_uring_sqe_set_data(sqe, f);
+		queued++;
+	}
+	io_ring_wait(queued, prefetch_done);
+#else
+	(void)files;
+	(void)count;
+#endif
+}
+
+static void io_op_run_sync(struct io_op *op)
+{
+	size_t len = 0;
+	ssize_t ret = 0;
+
+	op->fd = open(op->path, (op->write ? O_WRONLY | O_TRUNC : O_RDONLY) | O_CLOEXEC);
+	op->done = 1;
+	if (op->fd < 0) {
+		op->result = -errno;
+		return;
+	}
+	op->opened = 1;
+
+	if (op->write) {
+		do {
+			ret = write(op->fd, op->buf, op->len);
+		} while (ret < 0 && errno == EINTR);
+		op->result = ret < 0 ? -errno : ret;
+	} else {
+		while (len + 1 < op->len) {
+			ret = read(op->fd, op->buf + len, op->len - len - 1);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			len += ret;
+		}
+		op->result = ret < 0 ? -errno : (ssize_t)len;
+		op->buf[len] = 0;
+	}
+
+	close(op->fd);
+	op->fd = -1;
+}
+
+/*
+ * Run a batch of small file reads and writes.  Each op opens its file,
+ * reads or writes it once from the start, and closes it again.  Reads are
+ * NUL terminated.
+ */
+void io_batch_run(struct io_op *ops, int count)
+{
+	int i;
+#ifdef HAVE_LIBURING
+	int j, n;
+#endif
+
+	for (i = 0; i < count; i++) {
+		ops[i].fd = -1;
+		ops[i].opened = 0;
+		ops[i].done = 0;
+		ops[i].result = -EIO;
+	}
+
+	i = 0;
+#ifdef HAVE_LIBURING
+	for (; i < count && io_ring_ready(); i += n) {
+		n = count - i < IO_RING_ENTRIES ? count - i : IO_RING_ENTRIES;
+		io_ring_batch(&ops[i], n);
+
+		/* what the ring didn't finish is done the plain way */
+		for (j = i; j < i + n; j++) {
+			if (ops[j].done)
+				continue;
+			ops[j].opened = 0;
+			ops[j].result = -EIO;
+			io_op_run_sync(&ops[j]);
+		}
+	}
+#endif
+
+	for (; i < count; i++)
+		io_op_run_sync(&ops[i]);
+}
+
+/*
+ * Split the next line off a buffer returned by proc_file_read().  The
+ * newline is replaced by a NUL and *pos moves to the following line.
+ * Returns NULL at the end of the buffer.
+ */
+char *proc_file_next_line(char **pos)
+{
+	char *line = *pos;
+	char *nl;
+
+	if (!line || !*line)
+		return NULL;
+
+	nl = strchr(line, '\n');
+	if (nl) {
+		*nl = 0;
+		*pos = nl + 1;
+	} else
+		*pos = line + strlen(line);
+
+	return line;
+}
+
+/*
+ * One shot readers for small sysfs attributes.  A device or cpu directory
+ * is opened once and its attributes are read relative to it, straight into
+ * a caller supplied buffer, rather than walking the full path through
+ * stdio for each of them.
+ */
+int sysfs_open_dir(int dirfd, const char *name)
+{
+	return openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Read attribute name of the directory dirfd into buf, NUL terminated.
+ * Returns the length read, or -1 if the attribute can't be read.
+ */
+ssize_t sysfs_read_attr(int dirfd, const char *name, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	if (dirfd < 0 && dirfd != AT_FDCWD)
+		return -1;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	while (len + 1 < size) {
+		ret = read(fd, buf + len, size - len - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	close(fd);
+	buf[len] = 0;
+	return len;
+}
+
+/*
+ * Read an integer attribute, in the given base.  Returns 0 on success.
+ */
+int sysfs_read_int(int dirfd, const char *name, int base, int *val)
+{
+	char buf[64];
+	char *end;
+	long v;
+
+	if (sysfs_read_attr(dirfd, name, buf, sizeof(buf)) <= 0)
+		return -1;
+
+	v = strtol(buf, &end, base);
+	if (end == buf)
+		return -1;
+
+	*val = v;
+	return 0;
+}
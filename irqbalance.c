@@ -51,6 +51,8 @@ int foreground_mode;
 
 int numa_avail;
 int need_rescan;
+/* the rescan was asked for with SIGHUP, so nothing cached is trusted */
+static volatile int user_rescan;
 unsigned int log_mask = TO_ALL;
 enum hp_e hint_policy = HINT_POLICY_SUBSET;
 unsigned long power_thresh = ULONG_MAX;
@@ -59,6 +61,7 @@ unsigned long long cycle_count = 0;
 char *pidfile = NULL;
 char *banscript = NULL;
 char *polscript = NULL;
+int polscript_server = 0;
 long HZ;
 
 void sleep_approx(int seconds)
@@ -86,6 +89,7 @@ struct option lopts[] = {
 	{"banscript", 1, NULL, 'b'},
 	{"deepestcache", 1, NULL, 'c'},
 	{"policyscript", 1, NULL, 'l'},
+	{"policyserver", 0, NULL, 'L'},
 	{"pid", 1, NULL, 's'},
 	{0, 0, 0, 0}
 };
@@ -93,7 +97,7 @@ struct option lopts[] = {
 static void usage(void)
 {
 	log(TO_CONSOLE, LOG_INFO, "irqbalance [--oneshot | -o] [--debug | -d] [--foreground | -f] [--hintpolicy= | -h [exact|subset|ignore]]\n");
-	log(TO_CONSOLE, LOG_INFO, "	[--powerthresh= | -p <off> | <n>] [--banirq= | -i <n>] [--policyscript=<script>] [--pid= | -s <file>] [--deepestcache= | -c <n>]\n");
+	log(TO_CONSOLE, LOG_INFO, "	[--powerthresh= | -p <off> | <n>] [--banirq= | -i <n>] [--policyscript=<script>] [--policyserver | -L] [--pid= | -s <file>] [--deepestcache= | -c <n>]\n");
 }
 
 static void parse_command_line(int argc, char **argv)
@@ -103,7 +107,7 @@ static void parse_command_line(int argc, char **argv)
 	unsigned long val;
 
 	while ((opt = getopt_long(argc, argv,
-		"odfh:i:p:s:c:b:l:",
+		"odfh:i:p:s:c:b:l:L",
 		lopts, &longind)) != -1) {
 
 		switch(opt) {
@@ -160,6 +164,9 @@ static void parse_command_line(int argc, char **argv)
 			case 'l':
 				polscript = strdup(optarg);
 				break;
+			case 'L':
+				polscript_server = 1;
+				break;
 			case 'p':
 				if (!strncmp(optarg, "off", strlen(optarg)))
 					power_thresh = ULONG_MAX;
@@ -214,9 +221,10 @@ void force_rebalance_irq(struct irq_info *info, void *data __attribute__((unused
 	if (info->level == BALANCE_NONE)
 		return;
 
-	if (info->assigned_obj == NULL)
-		rebalance_irq_list = g_list_append(rebalance_irq_list, info);
-	else
+	if (info->assigned_obj == NULL) {
+		if (!info->list)
+			irq_list_add_tail(&rebalance_irq_list, info);
+	} else
 		migrate_irq(&info->assigned_obj->interrupts, &rebalance_irq_list, info);
 
 	info->assigned_obj = NULL;
@@ -231,8 +239,10 @@ static void handler(int signum)
 static void force_rescan(int signum)
 {
 	(void)signum;
-	if (cycle_count)
+	if (cycle_count) {
 		need_rescan = 1;
+		user_rescan = 1;
+	}
 }
 
 int main(int argc, char** argv)
@@ -258,6 +268,8 @@ int main(int argc, char** argv)
  	 */
 	openlog(argv[0], 0, LOG_DAEMON);
 
+	set_cpumask_width();
+
 // 通过环境变量获得要禁用 cpu，并解析成 bitmap
 	if (getenv("IRQBALANCE_BANNED_CPUS"))  {
 		cpumask_parse_user(getenv("IRQBALANCE_BANNED_CPUS"), strlen(getenv("IRQBALANCE_BANNED_CPUS")), banned_cpus);
@@ -301,6 +313,12 @@ int main(int argc, char** argv)
 	action.sa_flags = 0;
 	sigaction(SIGINT, &action, NULL);
 
+	/* a policy script that went away shows up as a failed write */
+	if (polscript_server) {
+		action.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &action, NULL);
+	}
+
 	build_object_tree();
 	if (debug_mode)   // debug 模式下， 打印 numa_node 节点的信息包括 number 和 cpu mask
 		dump_object_tree();
@@ -318,6 +336,8 @@ int main(int argc, char** argv)
 
 	if (!foreground_mode) {
 		int pidfd = -1;
+		/* the daemon gets a policy script of its own when it needs one */
+		policy_server_stop();
 		if (daemon(0,0))
 			exit(EXIT_FAILURE);
 		/* Write pidfile */
@@ -332,6 +352,8 @@ int main(int argc, char** argv)
 	}
 
 
+	uevent_open();
+
 #ifdef HAVE_LIBCAP_NG
 	// Drop capabilities
 	capng_clear(CAPNG_SELECT_BOTH);
@@ -341,7 +363,6 @@ int main(int argc, char** argv)
 
 	for_each_irq(NULL, force_rebalance_irq, NULL);
 
-	parse_proc_interrupts(); // 主要是计算每个中断的次数
 	parse_proc_stat();
 
 	hupaction.sa_handler = force_rescan;
@@ -350,13 +371,17 @@ int main(int argc, char** argv)
 	sigaction(SIGHUP, &hupaction, NULL);
 
 	while (keep_going) { //  循环执行，时间周期为 SLEEP_INTERVAL
-		sleep_approx(SLEEP_INTERVAL);
+		uevent_wait(SLEEP_INTERVAL);
 		log(TO_CONSOLE, LOG_INFO, "\n\n\n-----------------------------------------------------------------------------\n");
 		clear_work_stats();
+		prefetch_proc_counters();
 		parse_proc_interrupts();
 		parse_proc_stat();
 
-		/* cope with cpu hotplug -- detected during /proc/interrupts parsing */
+		/*
+		 * cope with cpu hotplug -- signalled by a uevent, or detected
+		 * during /proc/interrupts parsing
+		 */
 		if (need_rescan) {
 			need_rescan = 0;
 			cycle_count = 0;
@@ -364,9 +389,13 @@ int main(int argc, char** argv)
 			clear_work_stats();
 
 			free_object_tree();
+			/* pick up changes to the policy script and the devices */
+			if (user_rescan) {
+				user_rescan = 0;
+				invalidate_dev_cache(NULL);
+			}
 			build_object_tree();
 			for_each_irq(NULL, force_rebalance_irq, NULL);
-			parse_proc_interrupts();
 			parse_proc_stat();
 			sleep_approx(SLEEP_INTERVAL);
 			clear_work_stats();
@@ -387,6 +416,8 @@ int main(int argc, char** argv)
 		cycle_count++;
 
 	}
+	uevent_close();
+	policy_server_stop();
 	free_object_tree();
 
 	/* Remove pidfile */
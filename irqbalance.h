@@ -10,6 +10,7 @@
 #include <glib.h>
 #include <syslog.h>
 #include <limits.h>
+#include <sys/types.h>
 
 #include "types.h"
 #ifdef HAVE_NUMA_H
@@ -18,24 +19,29 @@
 #define numa_available() -1
 #endif
 
+extern int numa_node_count;
 extern int package_count;
 extern int cache_domain_count;
 extern int core_count;
 extern char *classes[];
 
+extern void sleep_approx(int seconds);
+extern void set_cpumask_width(void);
 extern void parse_cpu_tree(void);
 extern void clear_work_stats(void);
+extern void prefetch_proc_counters(void);
 extern void parse_proc_interrupts(void);
-extern GList* collect_full_irq_list();
+extern void update_proc_interrupts(void);
+extern void collect_proc_interrupts(void);
 extern void parse_proc_stat(void);
 extern void set_interrupt_count(int number, uint64_t count);
 extern void set_msi_interrupt_numa(int number);
 
-extern GList *rebalance_irq_list;
+extern struct irq_list rebalance_irq_list;
 
 void update_migration_status(void);
 void dump_workloads(void);
-void sort_irq_list(GList **list);
+void sort_irq_list(struct irq_list *list);
 void calculate_placement(void);
 void dump_tree(void);
 
@@ -68,6 +74,7 @@ extern unsigned long power_thresh;
 extern unsigned long deepest_cache;
 extern char *banscript;
 extern char *polscript;
+extern int polscript_server;
 extern cpumask_t banned_cpus;
 extern cpumask_t unbanned_cpus;
 extern long HZ;
@@ -80,6 +87,7 @@ extern void free_numa_node_list(void);
 extern void dump_numa_node_info(struct topo_obj *node, void *data);
 extern void add_package_to_node(struct topo_obj *p, int nodeid);
 extern struct topo_obj *get_numa_node(int nodeid);
+extern int cpu_numa_node_id(int cpu);
 
 /*
  * Package functions
@@ -95,9 +103,11 @@ extern struct topo_obj *get_numa_node(int nodeid);
 /*
  * cpu core functions
  */
-#define cpu_cache_domain(cpu) ((cpu)->parent)
-#define cpu_package(cpu) (cache_domain_package(cpu_cache_domain((cpu))))
-#define cpu_numa_node(cpu) (package_numa_node(cache_domain_package(cpu_cache_domain((cpu)))))
+extern struct cpu_topo *cpu_topo_index;
+extern int cpu_topo_index_size;
+#define cpu_cache_domain(cpu) (cpu_topo_index[(cpu)->number].cache_domain)
+#define cpu_package(cpu) (cpu_topo_index[(cpu)->number].package)
+#define cpu_numa_node(cpu) (cpu_topo_index[(cpu)->number].numa_node)
 extern struct topo_obj *find_cpu_core(int cpunr);
 extern int get_cpu_count(void);
 
@@ -107,13 +117,76 @@ extern int get_cpu_count(void);
 extern void rebuild_irq_db(void);
 extern void free_irq_db(void);
 extern void add_banned_irq(int irq);
-extern void for_each_irq(GList *list, void (*cb)(struct irq_info *info,  void *data), void *data);
+extern void for_each_irq(struct irq_list *list, void (*cb)(struct irq_info *info,  void *data), void *data);
 extern struct irq_info *get_irq_info(int irq);
-extern void migrate_irq(GList **from, GList **to, struct irq_info *info);
+extern void irq_list_add_tail(struct irq_list *list, struct irq_info *info);
+extern void irq_list_del(struct irq_info *info);
+extern void migrate_irq(struct irq_list *from, struct irq_list *to, struct irq_info *info);
 extern struct irq_info *add_new_irq(int irq, struct irq_info *hint);
+extern struct irq_info *add_hotplug_irq(int irq, struct irq_info *hint);
+extern void forget_hotplug_devs(void);
+extern void remove_stale_irqs(unsigned int generation);
+extern void invalidate_dev_cache(const char *name);
 extern void force_rebalance_irq(struct irq_info *info, void *data);
 #define irq_numa_node(irq) ((irq)->numa_node)
 
+/*
+ * Per cycle irq counters, see struct irq_counters
+ */
+extern struct irq_counters irq_counters;
+#define irq_load(irq) (irq_counters.load[(irq)->slot])
+#define irq_cpu_now(irq) (&irq_counters.cpu_now[(size_t)(irq)->slot * irq_counters.columns])
+#define irq_cpu_last(irq) (&irq_counters.cpu_last[(size_t)(irq)->slot * irq_counters.columns])
+extern int set_irq_counter_columns(int columns);
+
+
+/*
+ * Periodic file readers
+ */
+extern char *proc_file_read(struct proc_file *f);
+extern char *proc_file_next_line(char **pos);
+extern void proc_file_close(struct proc_file *f);
+extern void proc_file_prefetch(struct proc_file **files, int count);
+extern void io_batch_run(struct io_op *ops, int count);
+
+/*
+ * Sysfs attribute readers, big enough for a cpumask of any size
+ */
+#define SYSFS_ATTR_MAX	4096
+extern int sysfs_open_dir(int dirfd, const char *name);
+extern ssize_t sysfs_read_attr(int dirfd, const char *name, char *buf, size_t size);
+extern int sysfs_read_int(int dirfd, const char *name, int base, int *val);
+
+/*
+ * Kernel uevent functions
+ */
+extern int uevent_open(void);
+extern void uevent_close(void);
+extern void uevent_wait(int seconds);
+
+/*
+ * Long running policy script
+ */
+extern int policy_server_query(const char *path, int irq,
+			       void (*parse)(char *line, void *data), void *data);
+extern void policy_server_stop(void);
+
+/*
+ * Interned cpumask functions
+ */
+extern cpumask_id_t intern_cpumask(cpumask_t *mask);
+extern const cpumask_t *cpumask_of_id(cpumask_id_t id);
+extern int cpumask_id_weight(cpumask_id_t id);
+extern cpumask_id_t cpumask_id_and(cpumask_id_t a, cpumask_id_t b);
+#define cpumask_id_empty(id) (cpumask_id_weight(id) == 0)
+#define cpumask_id_intersects(a, b) (!cpumask_id_empty(cpumask_id_and((a), (b))))
+
+/*
+ * Object pool functions
+ */
+extern void *pool_alloc(struct obj_pool *pool);
+extern void pool_free(struct obj_pool *pool, void *obj);
+extern void pool_reset(struct obj_pool *pool);
 
 /*
  * Generic object functions
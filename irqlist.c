@@ -26,6 +26,7 @@
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -51,6 +52,18 @@ struct load_balance_info {
 	struct topo_obj *powersave;
 };
 
+/*
+ * The irqs placed above cpu level that the kernel delivers to just one
+ * cpu, grouped by that cpu.  The irqs of cpu n are effective_irqs[i] for
+ * effective_first[n] <= i < effective_first[n + 1], in the order the sorted
+ * lists of its cache domain, package and node have them.
+ */
+static struct irq_info **effective_irqs;
+static int effective_irqs_size;
+static int effective_count;
+static int *effective_first;
+static int effective_first_size;
+
 static void gather_load_stats(struct topo_obj *obj, void *data)
 {
 	struct load_balance_info *info = data;
@@ -81,7 +94,7 @@ static void move_candidate_irqs(struct irq_info *info, void *data)
  	 * hint_policy is HINT_POLICY_EXACT
  	 */
 	if (hint_policy == HINT_POLICY_EXACT)
-		if (!cpus_empty(info->affinity_hint))
+		if (!cpumask_id_empty(info->affinity_hint))
 			return;
 
 	/* Don't rebalance irqs that don't want it */
@@ -89,19 +102,19 @@ static void move_candidate_irqs(struct irq_info *info, void *data)
 		return;
 
 	/* Don't move cpus that only have one irq, regardless of load */
-	if (g_list_length(info->assigned_obj->interrupts) <= 1)
+	if (info->assigned_obj->interrupts.count <= 1)
 		return;
 
 	/* IRQs with a load of 1 have most likely not had any interrupts and
 	 * aren't worth migrating
 	 */
-	if (info->load <= 1)
+	if (irq_load(info) <= 1)
 		return;
 
 	/* If we can migrate an irq without swapping the imbalance do it. */
-	if ((lb_info->adjustment_load - info->load) > (lb_info->min_load + info->load)) {
-		lb_info->adjustment_load -= info->load;
-		lb_info->min_load += info->load;
+	if ((lb_info->adjustment_load - irq_load(info)) > (lb_info->min_load + irq_load(info))) {
+		lb_info->adjustment_load -= irq_load(info);
+		lb_info->min_load += irq_load(info);
 	} else
 		return;
 
@@ -112,9 +125,104 @@ static void move_candidate_irqs(struct irq_info *info, void *data)
 	info->assigned_obj = NULL;
 }
 
+/*
+ * The cpu the kernel delivers irq to, or -1 if it isn't just the one.  An
+ * irq placed on a cache domain or higher still lands on a single cpu.
+ */
+static int irq_effective_cpu(struct irq_info *info)
+{
+	int cpu;
+
+	if (cpumask_id_weight(info->effective_mask) != 1)
+		return -1;
+	cpu = first_cpu(*cpumask_of_id(info->effective_mask));
+
+	/* it may not have been placed there since */
+	if (!cpu_isset(cpu, *cpumask_of_id(info->assigned_obj->mask)))
+		return -1;
+	return cpu;
+}
+
+static void count_effective_irq(struct irq_info *info, void *data __attribute__((unused)))
+{
+	int cpu = irq_effective_cpu(info);
+
+	if (cpu < 0)
+		return;
+	effective_first[cpu + 2]++;
+	effective_count++;
+}
+
+static void count_effective_irqs(struct topo_obj *obj, void *data __attribute__((unused)))
+{
+	for_each_irq(&obj->interrupts, count_effective_irq, NULL);
+}
+
+static void add_effective_irq(struct irq_info *info, void *data __attribute__((unused)))
+{
+	int cpu = irq_effective_cpu(info);
+
+	if (cpu >= 0)
+		effective_irqs[effective_first[cpu + 1]++] = info;
+}
+
+static void add_effective_irqs(struct topo_obj *obj, void *data __attribute__((unused)))
+{
+	if (!obj->interrupts.head)
+		return;
+	/* order the list from least to greatest workload */
+	sort_irq_list(&obj->interrupts);
+	for_each_irq(&obj->interrupts, add_effective_irq, NULL);
+}
+
+/*
+ * Group the irqs placed above cpu level by the cpu they are delivered to.
+ * Nothing is sorted or stored unless effective affinity is known for some.
+ */
+static void group_effective_irqs(void)
+{
+	int size = cpu_topo_index_size + 2;
+	void *p;
+	int cpu;
+
+	effective_count = 0;
+	if (size > effective_first_size) {
+		p = realloc(effective_first, size * sizeof(int));
+		if (!p)
+			return;
+		effective_first = p;
+		effective_first_size = size;
+	}
+	memset(effective_first, 0, size * sizeof(int));
+
+	for_each_object(cache_domains, count_effective_irqs, NULL);
+	for_each_object(packages, count_effective_irqs, NULL);
+	for_each_object(numa_nodes, count_effective_irqs, NULL);
+	if (!effective_count)
+		return;
+
+	if (effective_count > effective_irqs_size) {
+		p = realloc(effective_irqs, effective_count * sizeof(struct irq_info *));
+		if (!p) {
+			effective_count = 0;
+			return;
+		}
+		effective_irqs = p;
+		effective_irqs_size = effective_count;
+	}
+
+	/* counts to start offsets, each shifted up by one cpu while filling */
+	for (cpu = 2; cpu < size; cpu++)
+		effective_first[cpu] += effective_first[cpu - 1];
+	for_each_object(cache_domains, add_effective_irqs, NULL);
+	for_each_object(packages, add_effective_irqs, NULL);
+	for_each_object(numa_nodes, add_effective_irqs, NULL);
+}
+
 static void migrate_overloaded_irqs(struct topo_obj *obj, void *data)
 {
 	struct load_balance_info *info = data;
+	int i;
 
 	if (obj->powersave_mode)
 		info->num_powersave++;
@@ -128,8 +236,11 @@ static void migrate_overloaded_irqs(struct topo_obj *obj, void *data)
 		info->num_over++;
 	}
 
-	if ((obj->load > info->min_load) &&
-	    (g_list_length(obj->interrupts) > 1)) {
+	if (obj->load <= info->min_load)
+		return;
+
+	info->adjustment_load = obj->load;
+	if (obj->interrupts.count > 1) {
 		/* order the list from least to greatest workload */
 		sort_irq_list(&obj->interrupts);
 		/*
@@ -140,9 +251,17 @@ static void migrate_overloaded_irqs(struct topo_obj *obj, void *data)
 		 * without reversing the imbalance or until we only have one
 		 * left.
 		 */
-		info->adjustment_load = obj->load;
-		for_each_irq(obj->interrupts, move_candidate_irqs, info);
+		for_each_irq(&obj->interrupts, move_candidate_irqs, info);
 	}
+
+	/*
+	 * A cpu is also loaded by the irqs placed above it that the kernel
+	 * chose to deliver to it, so those may have to move as well
+	 */
+	if (obj->obj_type != OBJ_TYPE_CPU || !effective_count)
+		return;
+	for (i = effective_first[obj->number]; i < effective_first[obj->number + 1]; i++)
+		move_candidate_irqs(effective_irqs[i], info);
 }
 
 static void force_irq_migration(struct irq_info *info, void *data __attribute__((unused)))
@@ -171,13 +290,15 @@ static void find_overloaded_objs(GList *name, struct load_balance_info *info) {
 void update_migration_status(void)
 {
 	struct load_balance_info info;
+
+	group_effective_irqs();
 	find_overloaded_objs(cpus, &info);
 	if (power_thresh != ULONG_MAX && cycle_count > 5) {
 		if (!info.num_over && (info.num_under >= power_thresh) && info.powersave) {
 			log(TO_ALL, LOG_INFO, "cpu %d entering powersave mode\n", info.powersave->number);
 			info.powersave->powersave_mode = 1;
-			if (g_list_length(info.powersave->interrupts) > 0)
-				for_each_irq(info.powersave->interrupts, force_irq_migration, NULL);
+			if (info.powersave->interrupts.head)
+				for_each_irq(&info.powersave->interrupts, force_irq_migration, NULL);
 		} else if ((info.num_over) && (info.num_powersave)) {
 			log(TO_ALL, LOG_INFO, "Load average increasing, re-enabling all cpus for irq balancing\n");
 			for_each_object(cpus, clear_powersave_mode, NULL);
@@ -191,7 +312,7 @@ void update_migration_status(void)
 static void dump_workload(struct irq_info *info, void *unused __attribute__((unused)))
 {
 	log(TO_CONSOLE, LOG_INFO, "Interrupt %i node_num %d (class %s) has workload %lu \n",
-	    info->irq, irq_numa_node(info)->number, classes[info->class], (unsigned long)info->load);
+	    info->irq, irq_numa_node(info)->number, classes[info->class], (unsigned long)irq_load(info));
 }
 
 void dump_workloads(void)
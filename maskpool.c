@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2012, Neil Horman <nhorman@tuxdriver.com>
+ *
+ * This file is part of irqbalance
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Interned cpumasks.  Every distinct mask is stored once and referred to
+ * by a small integer id, so two masks are equal exactly when their ids
+ * are.  Ids stay valid for the life of the daemon.  Handle 0 is always the
+ * empty mask, which makes a zeroed irq_info or topo_obj start out with an
+ * empty mask just as it did when the masks were embedded.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "irqbalance.h"
+
+struct mask_entry {
+	cpumask_t mask;
+	uint64_t hash;
+	int weight;
+};
+
+static struct mask_entry *masks;
+static unsigned int mask_count;
+static unsigned int mask_size;
+
+/*
+ * Open addressed hash from mask contents to id + 1, 0 marks a free bucket
+ */
+static unsigned int *mask_hash;
+static unsigned int mask_hash_size;
+
+/*
+ * Direct mapped cache of recent intersections
+ */
+#define AND_CACHE_SIZE 1024
+
+struct and_cache_entry {
+	cpumask_id_t a;
+	cpumask_id_t b;
+	cpumask_id_t result;
+	int valid;
+};
+
+static struct and_cache_entry and_cache[AND_CACHE_SIZE];
+
+static uint64_t hash_cpumask(cpumask_t *mask)
+{
+	int i, words = BITS_TO_LONGS(nr_cpumask_bits);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned long word;
+
+	for (i = 0; i < words; i++) {
+		word = mask->bits[i];
+		if (i == words - 1)
+			word &= BITMAP_LAST_WORD_MASK(nr_cpumask_bits);
+		hash ^= word;
+		hash *= 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+static int grow_mask_hash(void)
+{
+	unsigned int *new_hash;
+	unsigned int new_size, i, b;
+
+	new_size = mask_hash_size ? mask_hash_size * 2 : 64;
+	new_hash = calloc(new_size, sizeof(unsigned int));
+	if (!new_hash)
+		return -1;
+
+	for (i = 0; i < mask_count; i++) {
+		b = masks[i].hash & (new_size - 1);
+		while (new_hash[b])
+			b = (b + 1) & (new_size - 1);
+		new_hash[b] = i + 1;
+	}
+
+	free(mask_hash);
+	mask_hash = new_hash;
+	mask_hash_size = new_size;
+	return 0;
+}
+
+/*
+ * Return the id of mask, adding it to the table if it is new.  On
+ * allocation failure this falls back to the empty mask.
+ */
+cpumask_id_t intern_cpumask(cpumask_t *mask)
+{
+	struct mask_entry *new_masks;
+	uint64_t hash;
+	unsigned int b, id;
+
+	if (!mask_count) {
+		cpumask_t empty = CPU_MASK_NONE;
+
+		if (grow_mask_hash())
+			return 0;
+		masks = calloc(16, sizeof(struct mask_entry));
+		if (!masks)
+			return 0;
+		mask_size = 16;
+		masks[0].mask = empty;
+		masks[0].hash = hash_cpumask(&empty);
+		masks[0].weight = 0;
+		b = masks[0].hash & (mask_hash_size - 1);
+		mask_hash[b] = 1;
+		mask_count = 1;
+	}
+
+	hash = hash_cpumask(mask);
+	for (b = hash & (mask_hash_size - 1); mask_hash[b]; b = (b + 1) & (mask_hash_size - 1)) {
+		id = mask_hash[b] - 1;
+		if (masks[id].hash == hash && cpus_equal(masks[id].mask, *mask))
+			return id;
+	}
+
+	if (mask_count == mask_size) {
+		new_masks = realloc(masks, mask_size * 2 * sizeof(struct mask_entry));
+		if (!new_masks)
+			return 0;
+		masks = new_masks;
+		mask_size *= 2;
+	}
+
+	/* keep the hash at most half full */
+	if ((mask_count + 1) * 2 > mask_hash_size) {
+		if (grow_mask_hash())
+			return 0;
+		for (b = hash & (mask_hash_size - 1); mask_hash[b]; b = (b + 1) & (mask_hash_size - 1))
+			;
+	}
+
+	id = mask_count++;
+	masks[id].mask = *mask;
+	masks[id].hash = hash;
+	masks[id].weight = cpus_weight(*mask);
+	mask_hash[b] = id + 1;
+	return id;
+}
+
+/*
+ * The returned pointer is only good until the next intern_cpumask() call
+ */
+const cpumask_t *cpumask_of_id(cpumask_id_t id)
+{
+	static const cpumask_t empty = CPU_MASK_NONE;
+
+	if (id >= mask_count)
+		return &empty;
+	return &masks[id].mask;
+}
+
+int cpumask_id_weight(cpumask_id_t id)
+{
+	if (id >= mask_count)
+		return 0;
+	return masks[id].weight;
+}
+
+/*
+ * Intersection of two interned masks, memoized since the same few pairs
+ * (an irq's hint and the mask of the object it sits on) come up every cycle
+ */
+cpumask_id_t cpumask_id_and(cpumask_id_t a, cpumask_id_t b)
+{
+	struct and_cache_entry *e;
+	cpumask_id_t tmp;
+	cpumask_t result;
+
+	if (a == b)
+		return a;
+	if (a == CPUMASK_ID_EMPTY || b == CPUMASK_ID_EMPTY)
+		return CPUMASK_ID_EMPTY;
+	if (a > b) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	e = &and_cache[(a * 31 + b) & (AND_CACHE_SIZE - 1)];
+	if (e->valid && e->a == a && e->b == b)
+		return e->result;
+
+	cpus_and(result, masks[a].mask, masks[b].mask);
+	e->a = a;
+	e->b = b;
+	e->result = intern_cpumask(&result);
+	e->valid = 1;
+	return e->result;
+}
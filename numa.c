@@ -37,20 +37,54 @@
 #define SYSFS_NODE_PATH "/sys/devices/system/node"
 
 GList *numa_nodes = NULL;
+int numa_node_count;
+
+static struct obj_pool numa_node_pool = OBJ_POOL_INIT(struct topo_obj, 16);
 
 static struct topo_obj unspecified_node_template = {  // 模板，初始化
 	.load = 0,
 	.number = -1,
 	.obj_type = OBJ_TYPE_NODE,
-	.mask = CPU_MASK_ALL,
-	.interrupts = NULL,
+	.interrupts = { NULL, NULL },
 	.children = NULL,
 	.parent = NULL,
 	.obj_type_list = &numa_nodes,
+	.obj_type_count = &numa_node_count,
 };
 
 static struct topo_obj unspecified_node;
 
+/*
+ * Dense index of the numa_nodes list, addressed by node id
+ */
+static struct topo_obj **numa_node_index;
+static int numa_node_index_size;
+
+static int set_numa_node_index(int nodeid, struct topo_obj *node)
+{
+	struct topo_obj **new_index;
+	int new_size;
+
+	if (nodeid < 0)
+		return -1;
+
+	if (nodeid >= numa_node_index_size) {
+		new_size = numa_node_index_size ? numa_node_index_size : 8;
+		while (new_size <= nodeid)
+			new_size *= 2;
+		new_index = realloc(numa_node_index, new_size * sizeof(struct topo_obj *));
+		if (!new_index)
+			return -1;
+		memset(&new_index[numa_node_index_size], 0,
+		       (new_size - numa_node_index_size) * sizeof(struct topo_obj *));
+		numa_node_index = new_index;
+		numa_node_index_size = new_size;
+	}
+
+	numa_node_index[nodeid] = node;
+	return 0;
+}
+
 // 根据节点名字，往 numa_nodes list 中添加一个 node 结构
 static void add_one_node(const char *nodename)
 {
@@ -60,32 +94,40 @@ static void add_one_node(const char *nodename)
 	FILE *f;
 	ssize_t ret;
 	size_t blen;
+	cpumask_t mask;
 
-	new = calloc(1, sizeof(struct topo_obj)); // 分配一块 topo_obj 大小的内存，若失败，直接返回
+	new = pool_alloc(&numa_node_pool); // 分配一块 topo_obj 大小的内存，若失败，直接返回
 	if (!new)
 		return;
-	sprintf(n, "%s/%s/cpumap", SYSFS_NODE_PATH, nodename); // path=/sys/devices/system/node/nodename/cpumap, nodename=node0/1..
+	sprintf(path, "%s/%s/cpumap", SYSFS_NODE_PATH, nodename); // path=/sys/devices/system/node/nodename/cpumap, nodename=node0/1..
 	f = fopen(path, "r");
 	if (!f) {
-		free(new);
+		pool_free(&numa_node_pool, new);
 		return;
 	}
 	if (ferror(f)) {
-		cpus_clear(new->mask); // 将 bitmap 先清空
+		cpus_clear(mask); // 将 bitmap 先清空
 	} else {
 		ret = getline(&cpustr, &blen, f);               // cpustr 得到一个 hex 的字符串
 		if (ret <= 0) {
-			cpus_clear(new->mask);
+			cpus_clear(mask);
 		} else {
-			cpumask_parse_user(cpustr, ret, new->mask); // 将 cpustr (如 ffff,ffffffff) 解析到 bitmap 中
+			cpumask_parse_user(cpustr, ret, mask); // 将 cpustr (如 ffff,ffffffff) 解析到 bitmap 中
 			free(cpustr);
 		}
 	}
 	fclose(f);
+	new->mask = intern_cpumask(&mask);
 	new->obj_type = OBJ_TYPE_NODE;                     // 类型为 numa node
 	new->number = strtoul(&nodename[4], NULL, 10);     // node 序号从文件名获取，如 0/1..等
 	new->obj_type_list = &numa_nodes;
+	new->obj_type_count = &numa_node_count;
+	if (set_numa_node_index(new->number, new)) {
+		pool_free(&numa_node_pool, new);
+		return;
+	}
 	numa_nodes = g_list_append(numa_nodes, new);      // 将新node 添加到 numa_nodes 这个 list 上
+	numa_node_count++;
 }
 
 // 新建一个 numa_nodes list，并将所有的 numa node 加进去, 如果支持 numa 结构的话
@@ -93,6 +135,7 @@ void build_numa_node_list(void)
 {
 	DIR *dir;
 	struct dirent *entry;
+	cpumask_t mask;
 
 	/*
 	 * Note that we copy the unspcified node from the template here
@@ -101,12 +144,15 @@ void build_numa_node_list(void)
 	 */
 	// 利用模版结构 unspecified_node_template 创建一个 numa node 结构
 	memcpy(&unspecified_node, &unspecified_node_template, sizeof (struct topo_obj));
+	cpus_setall(mask);
+	unspecified_node.mask = intern_cpumask(&mask);
 
 	/*
 	 * Add the unspecified node
 	 */
 	// 将该结构加入到NUMA域链表中，作为一个无实际意义的头结点 dummy head
 	numa_nodes = g_list_append(numa_nodes, &unspecified_node);
+	numa_node_count++;
 
 	if (!numa_avail) // 不支持 numa 结构， 直接返回
 		return;
@@ -130,10 +176,6 @@ static void free_numa_node(gpointer data)
 {
 	struct topo_obj *obj = data;
 	g_list_free(obj->children);
-	g_list_free(obj->interrupts);
-
-	if (data != &unspecified_node)
-		free(data);
 }
 
 // glist 释放内存
@@ -141,16 +183,12 @@ void free_numa_node_list(void)
 {
 	g_list_free_full(numa_nodes, free_numa_node);
 	numa_nodes = NULL;
+	numa_node_count = 0;
+	pool_reset(&numa_node_pool);
+	if (numa_node_index)
+		memset(numa_node_index, 0, numa_node_index_size * sizeof(struct topo_obj *));
 }
 
-// 比较 2 个节点的 numa number 是否相同，相同返回 0，否则返回 1
-static gint compare_node(gconstpointer a, gconstpointer b)
-{
-	const struct topo_obj *ai = a;
-	const struct topo_obj *bi = b;
-
-	return (ai->number == bi->number) ? 0 : 1;
-}
 // 将一个 package 结构加入到 nodeid 这个 node 结构
 void add_package_to_node(struct topo_obj *p, int nodeid)
 {
@@ -166,6 +204,7 @@ void add_package_to_node(struct topo_obj *p, int nodeid)
 
 	if (!p->parent) {
 		node->children = g_list_append(node->children, p);
+		node->num_children++;
 		p->parent = node;
 	}
 }
@@ -176,25 +215,38 @@ void dump_numa_node_info(struct topo_obj *d, void *unused __attribute__((unused)
 {
 	char buffer[4096];
 	log(TO_CONSOLE, LOG_INFO, "NUMA NODE NUMBER: %d\n", d->number);
-	cpumask_scnprintf(buffer, 4096, d->mask);  // 将 bitmap 形式的掩码转换成 char*
+	cpumask_scnprintf(buffer, 4096, *cpumask_of_id(d->mask));  // 将 bitmap 形式的掩码转换成 char*
 	log(TO_CONSOLE, LOG_INFO, "LOCAL CPU MASK: %s\n", buffer);
 	log(TO_CONSOLE, LOG_INFO, "\n");
 }
 
-// 根据 nodeid 从 numa_nodes list 中获得 numa 节点， 不存在的话返回 null
-struct topo_obj *get_numa_node(int nodeid)
+/*
+ * Id of the numa node whose cpumap holds cpu, or -1 if none does
+ */
+int cpu_numa_node_id(int cpu)
 {
-	struct topo_obj find;
+	struct topo_obj *node;
 	GList *entry;
 
+	for (entry = numa_nodes; entry; entry = g_list_next(entry)) {
+		node = entry->data;
+		if (node->number >= 0 && cpu_isset(cpu, *cpumask_of_id(node->mask)))
+			return node->number;
+	}
+	return -1;
+}
+
+// 根据 nodeid 从 numa_nodes list 中获得 numa 节点， 不存在的话返回 null
+struct topo_obj *get_numa_node(int nodeid)
+{
 	if (!numa_avail)
 		return &unspecified_node;
 
 	if (nodeid == -1)
 		return &unspecified_node;
 
-	find.number = nodeid;
+	if (nodeid < 0 || nodeid >= numa_node_index_size)
+		return NULL;
 
-	entry = g_list_find_custom(numa_nodes, &find, compare_node);
-	return entry ? entry->data : NULL;
+	return numa_node_index[nodeid];
 }
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2012, Neil Horman <nhorman@tuxdriver.com>
+ *
+ * This file is part of irqbalance
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Fixed size object pools used for the topology tree and the irq database.
+ * Objects are carved sequentially out of large chunks, so objects of one
+ * kind sit next to each other in memory.  A rebuild of the tree or the db
+ * releases everything at once with pool_reset(), which keeps the chunks
+ * around so the next generation is allocated from the same memory.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "irqbalance.h"
+
+struct pool_chunk {
+	struct pool_chunk *next;
+	char objs[] __attribute__((aligned(16)));
+};
+
+struct free_obj {
+	struct free_obj *next;
+};
+
+static size_t pool_obj_size(struct obj_pool *pool)
+{
+	return (pool->obj_size + 15) & ~((size_t)15);
+}
+
+void *pool_alloc(struct obj_pool *pool)
+{
+	struct pool_chunk *chunk;
+	size_t size = pool_obj_size(pool);
+	void *obj;
+
+	if (pool->free_list) {
+		obj = pool->free_list;
+		pool->free_list = pool->free_list->next;
+		memset(obj, 0, size);
+		return obj;
+	}
+
+	if (!pool->current || pool->used == pool->objs_per_chunk) {
+		chunk = pool->current ? pool->current->next : pool->chunks;
+		if (!chunk) {
+			chunk = malloc(sizeof(struct pool_chunk) + size * pool->objs_per_chunk);
+			if (!chunk)
+				return NULL;
+			chunk->next = NULL;
+			if (pool->current)
+				pool->current->next = chunk;
+			else
+				pool->chunks = chunk;
+		}
+		pool->current = chunk;
+		pool->used = 0;
+	}
+
+	obj = pool->current->objs + size * pool->used++;
+	memset(obj, 0, size);
+	return obj;
+}
+
+void pool_free(struct obj_pool *pool, void *obj)
+{
+	struct free_obj *f = obj;
+
+	if (!obj)
+		return;
+
+	f->next = pool->free_list;
+	pool->free_list = f;
+}
+
+/*
+ * Release every object allocated from the pool.  The chunks are kept
+ * and handed out again in the same order.
+ */
+void pool_reset(struct obj_pool *pool)
+{
+	pool->current = NULL;
+	pool->used = 0;
+	pool->free_list = NULL;
+}
@@ -29,59 +29,176 @@
 #include "irqbalance.h"
 
 
-GList *rebalance_irq_list;
+struct irq_list rebalance_irq_list;
 
-struct obj_placement {
-		struct topo_obj *best;
-		struct topo_obj *least_irqs;
-		uint64_t best_cost;
-		struct irq_info *info;
+/*
+ * Min-heap of the objects an irq can be placed on below one parent.
+ * Objects are ordered by load, then by the number of irqs they carry, then
+ * by their position in the parent's child list, so that the best candidate
+ * is always at the top.  Loads only ever grow while irqs are placed, so an
+ * assignment just sifts the chosen object down.
+ */
+struct heap_entry {
+	struct topo_obj *obj;
+	int order;
+};
+
+struct obj_heap {
+	struct heap_entry *entries;
+	int count;	/* entries in the heap proper */
+	int total;	/* count plus entries set aside by find_best_object */
+	int size;
 };
 
-static void find_best_object(struct topo_obj *d, void *data)
+static struct obj_heap node_heap;
+static struct obj_heap child_heap;
+
+static int heap_entry_less(struct heap_entry *a, struct heap_entry *b)
+{
+	if (a->obj->load != b->obj->load)
+		return a->obj->load < b->obj->load;
+	if (a->obj->interrupts.count != b->obj->interrupts.count)
+		return a->obj->interrupts.count < b->obj->interrupts.count;
+	return a->order < b->order;
+}
+
+static void heap_swap(struct obj_heap *heap, int i, int j)
+{
+	struct heap_entry tmp = heap->entries[i];
+
+	heap->entries[i] = heap->entries[j];
+	heap->entries[j] = tmp;
+	heap->entries[i].obj->heap_pos = i;
+	heap->entries[j].obj->heap_pos = j;
+}
+
+static void heap_sift_up(struct obj_heap *heap, int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!heap_entry_less(&heap->entries[i], &heap->entries[parent]))
+			break;
+		heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void heap_sift_down(struct obj_heap *heap, int i)
 {
-	struct obj_placement *best = (struct obj_placement *)data;
-	uint64_t newload;
-	cpumask_t subset;
+	int child, min;
+
+	for (;;) {
+		min = i;
+		child = 2 * i + 1;
+		if (child < heap->count &&
+		    heap_entry_less(&heap->entries[child], &heap->entries[min]))
+			min = child;
+		child++;
+		if (child < heap->count &&
+		    heap_entry_less(&heap->entries[child], &heap->entries[min]))
+			min = child;
+		if (min == i)
+			break;
+		heap_swap(heap, i, min);
+		i = min;
+	}
+}
 
+/*
+ * Objects that can never take an irq in this pass are left out of the heap
+ */
+static int object_can_take_irqs(struct topo_obj *d)
+{
 	/*
  	 * Don't consider the unspecified numa node here
  	 */
 	if (numa_avail && (d->obj_type == OBJ_TYPE_NODE) && (d->number == -1))
-		return;
+		return 0;
 
-	/*
- 	 * If the hint policy is subset, then we only want
- 	 * to consider objects that are within the irqs hint, but
- 	 * only if that irq in fact has published a hint
- 	 */
-	if (hint_policy == HINT_POLICY_SUBSET) {
-		if (!cpus_empty(best->info->affinity_hint)) {
-			cpus_and(subset, best->info->affinity_hint, d->mask);
-			if (cpus_empty(subset))
-				return;
-		}
+	if (d->powersave_mode)
+		return 0;
+
+	return 1;
+}
+
+static void build_obj_heap(struct obj_heap *heap, GList *objs)
+{
+	struct heap_entry *entries;
+	struct topo_obj *d;
+	int order = 0, i;
+	int len = g_list_length(objs);
+
+	heap->count = heap->total = 0;
+	if (len > heap->size) {
+		entries = realloc(heap->entries, len * sizeof(struct heap_entry));
+		if (!entries)
+			return;
+		heap->entries = entries;
+		heap->size = len;
 	}
 
-	if (d->powersave_mode)
-		return;
+	for (; objs; objs = g_list_next(objs), order++) {
+		d = objs->data;
+		d->heap_pos = -1;
+		if (!object_can_take_irqs(d))
+			continue;
+		heap->entries[heap->count].obj = d;
+		heap->entries[heap->count].order = order;
+		d->heap_pos = heap->count++;
+	}
+	heap->total = heap->count;
+
+	for (i = heap->count / 2 - 1; i >= 0; i--)
+		heap_sift_down(heap, i);
+}
 
-	newload = d->load;
-	if (newload < best->best_cost) {
-		best->best = d;
-		best->best_cost = newload;
-		best->least_irqs = NULL;
+/*
+ * If the hint policy is subset, then we only want
+ * to consider objects that are within the irqs hint, but
+ * only if that irq in fact has published a hint
+ */
+static int object_fits_hint(struct topo_obj *d, struct irq_info *info)
+{
+	if (hint_policy != HINT_POLICY_SUBSET || cpumask_id_empty(info->affinity_hint))
+		return 1;
+
+	return cpumask_id_intersects(info->affinity_hint, d->mask);
+}
+
+/*
+ * Return the least loaded object on the heap that info may be placed on.
+ * Objects that don't match the irq are popped and parked past the end of
+ * the heap, update_obj_heap() puts them back.
+ */
+static struct topo_obj *find_best_object(struct obj_heap *heap, struct irq_info *info)
+{
+	while (heap->count && !object_fits_hint(heap->entries[0].obj, info)) {
+		heap->count--;
+		heap_swap(heap, 0, heap->count);
+		heap_sift_down(heap, 0);
 	}
 
-	if (newload == best->best_cost) {
-		if (g_list_length(d->interrupts) < g_list_length(best->best->interrupts))
-			best->least_irqs = d;
+	return heap->count ? heap->entries[0].obj : NULL;
+}
+
+/*
+ * Restore the heap after the load or irq count of d went up
+ */
+static void update_obj_heap(struct obj_heap *heap, struct topo_obj *d)
+{
+	if (d && d->heap_pos >= 0 && d->heap_pos < heap->count)
+		heap_sift_down(heap, d->heap_pos);
+
+	while (heap->count < heap->total) {
+		heap->count++;
+		heap_sift_up(heap, heap->count - 1);
 	}
 }
 
 static void find_best_object_for_irq(struct irq_info *info, void *data)
 {
-	struct obj_placement place;
 	struct topo_obj *d = data;
 	struct topo_obj *asign;
 
@@ -110,31 +227,26 @@ static void find_best_object_for_irq(struct irq_info *info, void *data)
 		break;
 	}
 
-	place.info = info;
-	place.best = NULL;
-	place.least_irqs = NULL;
-	place.best_cost = ULLONG_MAX;
-
-	for_each_object(d->children, find_best_object, &place);
-
-	asign = place.least_irqs ? place.least_irqs : place.best;
+	asign = find_best_object(&child_heap, info);
 
 	if (asign) {
 		migrate_irq(&d->interrupts, &asign->interrupts, info);
 		info->assigned_obj = asign;
-		asign->load += info->load;
+		asign->load += irq_load(info);
 	}
+	update_obj_heap(&child_heap, asign);
 }
 
 static void place_irq_in_object(struct topo_obj *d, void *data __attribute__((unused)))
 {
-	if (g_list_length(d->interrupts) > 0)
-		for_each_irq(d->interrupts, find_best_object_for_irq, d);
+	if (d->interrupts.head) {
+		build_obj_heap(&child_heap, d->children);
+		for_each_irq(&d->interrupts, find_best_object_for_irq, d);
+	}
 }
 
 static void place_irq_in_node(struct irq_info *info, void *data __attribute__((unused)))
 {
-	struct obj_placement place;
 	struct topo_obj *asign;
 
 	if( info->level == BALANCE_NONE)
@@ -147,24 +259,19 @@ static void place_irq_in_node(struct irq_info *info, void *data __attribute__((u
  		 */
 		migrate_irq(&rebalance_irq_list, &irq_numa_node(info)->interrupts, info);
 		info->assigned_obj = irq_numa_node(info);
-		irq_numa_node(info)->load += info->load + 1;
+		irq_numa_node(info)->load += irq_load(info) + 1;
+		update_obj_heap(&node_heap, irq_numa_node(info));
 		return;
 	}
 
-	place.best_cost = ULLONG_MAX;
-	place.best = NULL;
-	place.least_irqs = NULL;
-	place.info = info;
-
-	for_each_object(numa_nodes, find_best_object, &place);
-
-	asign = place.least_irqs ? place.least_irqs : place.best;
+	asign = find_best_object(&node_heap, info);
 
 	if (asign) {
 		migrate_irq(&rebalance_irq_list, &asign->interrupts, info);
 		info->assigned_obj = asign;
-		asign->load += info->load;
+		asign->load += irq_load(info);
 	}
+	update_obj_heap(&node_heap, asign);
 }
 
 static void validate_irq(struct irq_info *info, void *data)
@@ -176,8 +283,8 @@ static void validate_irq(struct irq_info *info, void *data)
 
 static void validate_object(struct topo_obj *d, void *data __attribute__((unused)))
 {
-	if (g_list_length(d->interrupts) > 0)
-		for_each_irq(d->interrupts, validate_irq, d);
+	if (d->interrupts.head)
+		for_each_irq(&d->interrupts, validate_irq, d);
 }
 
 static void validate_object_tree_placement(void)
@@ -190,8 +297,9 @@ static void validate_object_tree_placement(void)
 void calculate_placement(void)
 {
 	sort_irq_list(&rebalance_irq_list);
-	if (g_list_length(rebalance_irq_list) > 0) {
-		for_each_irq(rebalance_irq_list, place_irq_in_node, NULL);
+	if (rebalance_irq_list.head) {
+		build_obj_heap(&node_heap, numa_nodes);
+		for_each_irq(&rebalance_irq_list, place_irq_in_node, NULL);
 		for_each_object(numa_nodes, place_irq_in_object, NULL);
 		for_each_object(packages, place_irq_in_object, NULL);
 		for_each_object(cache_domains, place_irq_in_object, NULL);
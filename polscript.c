@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2012, Neil Horman <nhorman@tuxdriver.com>
+ *
+ * This file is part of irqbalance
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/*
+ * With --policyserver the policy script is started once and kept running,
+ * rather than run once per irq.  Each query is a line "<path> <irq>" on the
+ * script's stdin, and the script answers with the same key=value lines it
+ * would print when run per irq, followed by an empty line.  A script that
+ * exits or stops answering is started again at the next query.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "irqbalance.h"
+
+/* how long the script gets to answer a query, in milliseconds */
+#define POLICY_SERVER_TIMEOUT	5000
+/* seconds before a script that never answered is started again */
+#define POLICY_SERVER_RESTART	30
+/* the most key=value lines in one answer */
+#define POLICY_SERVER_LINES	16
+
+struct policy_server {
+	pid_t pid;
+	int in;			/* the script's stdin */
+	int out;		/* the script's stdout */
+	int answered;		/* has answered since it was started */
+	int refused;		/* the backoff has been reported */
+	time_t started;
+	char buf[4096];		/* what has been read but not parsed yet */
+	size_t len;
+};
+
+static struct policy_server server = { .pid = -1, .in = -1, .out = -1 };
+
+#ifdef HAVE_LIBPTHREAD
+/* the device scan asks from several threads */
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+#define server_lock()	pthread_mutex_lock(&server_lock)
+#define server_unlock()	pthread_mutex_unlock(&server_lock)
+#else
+#define server_lock()	do { } while (0)
+#define server_unlock()	do { } while (0)
+#endif
+
+static time_t monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void stop_server(void)
+{
+	if (server.in >= 0)
+		close(server.in);
+	if (server.out >= 0)
+		close(server.out);
+	server.in = server.out = -1;
+
+	/* it may be stuck, so don't wait for it to see its stdin close */
+	if (server.pid > 0 && waitpid(server.pid, NULL, WNOHANG) == 0) {
+		kill(server.pid, SIGKILL);
+		waitpid(server.pid, NULL, 0);
+	}
+	server.pid = -1;
+	server.len = 0;
+}
+
+static int start_server(void)
+{
+	int to_child[2], from_child[2];
+	char *cmd;
+	pid_t pid;
+
+	/*
+	 * Don't keep restarting a script that can't get going.  Said once,
+	 * the queries until the next start fail quietly.
+	 */
+	if (server.started && !server.answered &&
+	    monotonic_seconds() - server.started < POLICY_SERVER_RESTART) {
+		if (!server.refused)
+			log(TO_ALL, LOG_WARNING, "Policy script %s is not answering, "
+			    "using default policies for up to %d seconds\n",
+			    polscript, POLICY_SERVER_RESTART);
+		server.refused = 1;
+		return -1;
+	}
+
+	cmd = alloca(strlen(polscript) + 8);
+	sprintf(cmd, "exec %s", polscript);
+
+	/* a start that fails counts as one that didn't answer */
+	server.started = monotonic_seconds();
+	server.answered = 0;
+
+	if (pipe2(to_child, O_CLOEXEC))
+		goto fail;
+	if (pipe2(from_child, O_CLOEXEC)) {
+		close(to_child[0]);
+		close(to_child[1]);
+		goto fail;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(to_child[0]);
+		close(to_child[1]);
+		close(from_child[0]);
+		close(from_child[1]);
+		goto fail;
+	}
+
+	if (!pid) {
+		if (dup2(to_child[0], STDIN_FILENO) < 0 ||
+		    dup2(from_child[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+
+	close(to_child[0]);
+	close(from_child[1]);
+	server.pid = pid;
+	server.in = to_child[1];
+	server.out = from_child[0];
+	server.refused = 0;
+	server.len = 0;
+	log(TO_CONSOLE, LOG_INFO, "Started policy script %s as pid %d\n", polscript, (int)pid);
+	return 0;
+
+fail:
+	log(TO_ALL, LOG_WARNING, "Unable to start policy script %s\n", polscript);
+	server.refused = 1;
+	return -1;
+}
+
+static int write_query(const char *query, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(server.in, query, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		query += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Return the next line of the answer, without its newline, or NULL if the
+ * script went away or took too long
+ */
+static char *read_line(char *line, size_t size)
+{
+	struct pollfd pfd = { .fd = server.out, .events = POLLIN };
+	char *end;
+	size_t n;
+	ssize_t ret;
+
+	for (;;) {
+		end = memchr(server.buf, '\n', server.len);
+		if (end) {
+			n = end - server.buf;
+			if (n >= size)
+				n = size - 1;
+			memcpy(line, server.buf, n);
+			line[n] = '\0';
+			n = end - server.buf + 1;
+			memmove(server.buf, server.buf + n, server.len - n);
+			server.len -= n;
+			return line;
+		}
+
+		/* a line too long to be any of ours */
+		if (server.len == sizeof(server.buf))
+			return NULL;
+
+		ret = poll(&pfd, 1, POLICY_SERVER_TIMEOUT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			log(TO_ALL, LOG_WARNING, "Policy script %s is not answering\n", polscript);
+			return NULL;
+		}
+
+		ret = read(server.out, server.buf + server.len, sizeof(server.buf) - server.len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return NULL;
+		server.len += ret;
+	}
+}
+
+/*
+ * Send one query and hand each key=value line of the answer to parse.
+ * Nothing is parsed until the whole answer is in.
+ */
+static int ask_server(const char *query, size_t len,
+		      void (*parse)(char *line, void *data), void *data)
+{
+	char lines[POLICY_SERVER_LINES][128];
+	int count = 0, i;
+
+	if (server.pid < 0 && start_server())
+		return -1;
+
+	if (write_query(query, len))
+		return -1;
+
+	while (read_line(lines[count], sizeof(lines[count]))) {
+		if (lines[count][0]) {
+			/* more keys than there are is a confused script */
+			if (++count == POLICY_SERVER_LINES)
+				return -1;
+			continue;
+		}
+
+		server.answered = 1;
+		for (i = 0; i < count; i++)
+			parse(lines[i], data);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Ask the long running policy script about irq.  A script that has gone
+ * away is started again, once per query.  Returns 0 if it answered.
+ */
+int policy_server_query(const char *path, int irq,
+			void (*parse)(char *line, void *data), void *data)
+{
+	char *query;
+	size_t len;
+	int ret;
+
+	query = alloca(strlen(path) + 16);
+	len = sprintf(query, "%s %d\n", path, irq);
+
+	server_lock();
+	ret = ask_server(query, len, parse, data);
+	if (ret) {
+		/* a late answer would be taken for the next query's */
+		stop_server();
+		ret = ask_server(query, len, parse, data);
+		if (ret)
+			stop_server();
+	}
+	server_unlock();
+	return ret;
+}
+
+void policy_server_stop(void)
+{
+	server_lock();
+	stop_server();
+	server_unlock();
+}
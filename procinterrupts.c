@@ -31,168 +31,314 @@
 #include "cpumask.h"
 #include "irqbalance.h"
 
-#define LINESIZE 4096
-
 static int proc_int_has_msi = 0;
 static int msi_found_in_sysfs = 0;
 
-// /proc/interrupts 文件解析，将数字开头的中断号解析成 irq_info 结构，放入 list 中
-GList* collect_full_irq_list()
-{
-	GList *tmp_list = NULL;
-	FILE *file;
-	char *line = NULL;
-	size_t size = 0;
-	char *irq_name, *savedptr, *last_token, *p;
-
-	file = fopen("/proc/interrupts", "r");
-	if (!file)
-		return NULL;
+static struct proc_file proc_interrupts = PROC_FILE_INIT("/proc/interrupts");
+static struct proc_file proc_stat = PROC_FILE_INIT("/proc/stat");
+static struct proc_file proc_softirqs = PROC_FILE_INIT("/proc/softirqs");
 
-	/* first line is the header we don't need; nuke it */
-	if (getline(&line, &size, file)==0) {  // 第一行是CPU编号，忽略掉
-		free(line);
-		fclose(file);
-		return NULL;
-	}
+/*
+ * Softirqs are charged to the irqs whose class raises them: network
+ * softirqs to network irqs, block softirqs to storage irqs.  The rest of
+ * the softirq time, and all of the hardirq time, goes to every irq.
+ */
+enum softirq_group {
+	SOFTIRQ_ALL,
+	SOFTIRQ_NET,
+	SOFTIRQ_BLOCK,
+	SOFTIRQ_GROUPS
+};
 
-	while (!feof(file)) {
-		int	 number;
-		struct irq_info *info;
-		char *c;
-		char savedline[1024];
+/*
+ * Softirq accounting per cpu number.  /proc/stat gives the time spent in
+ * softirqs, /proc/softirqs how many of each kind ran.
+ */
+struct cpu_softirq {
+	uint64_t last_time;		/* softirq jiffies at the last sample */
+	uint64_t time;			/* softirq ns over the last interval */
+	uint64_t count[SOFTIRQ_GROUPS];
+	uint64_t last_count[SOFTIRQ_GROUPS];
+};
 
-		if (getline(&line, &size, file)==0)
-			break;
+static struct cpu_softirq *cpu_softirq;
 
-		/* lines with letters in front are special, like NMI count. Ignore */
-		// 以空格+字母开头的行忽略掉
-		c = line;
-		while (isblank(*(c))) // 跳过空格,每行开头有空格
-			c++;
+/*
+ * Per column scratch space for load attribution, a column is a cpu
+ * column of /proc/interrupts
+ */
+struct column_load {
+	uint64_t total[SOFTIRQ_GROUPS];	/* interrupts by irqs of the group */
+	uint64_t rate[SOFTIRQ_GROUPS];	/* ns per interrupt, fixed point */
+};
 
-		// 只在乎数字表示的中换号，NMI/LOC 等开头的行忽略掉,NMI 和 LOC 是系统所使用的驱动，用户无法访问和配置
-		if (!(*c>='0' && *c<='9'))
-			break;
-		c = strchr(line, ':'); // 中断号后面是冒号
-		if (!c)
-			continue;
+static struct column_load *column_load;
+static unsigned int *row_counts;
+static int column_load_size;
 
-		strncpy(savedline, line, sizeof(savedline));
+/*
+ * The cpu number of each count column of /proc/interrupts and of
+ * /proc/softirqs, taken from their headers
+ */
+static int *irq_column_cpu;
+static int irq_column_size;
+static int *softirq_column_cpu;
+static int softirq_column_size;
 
-		irq_name = strtok_r(savedline, " ", &savedptr);
-		last_token = strtok_r(NULL, " ", &savedptr);
-		while ((p = strtok_r(NULL, " ", &savedptr))) {
-			irq_name = last_token;  // 中断控制器
-			last_token = p;         // 设备名
-		}
+/*
+ * One row of /proc/interrupts, as found by scan_irq_row().  The name
+ * fields point into the read buffer and are not NUL terminated.
+ */
+struct irq_row {
+	int irq;		/* -1 for the named rows like NMI or LOC */
+	int cpus;		/* number of per cpu count columns */
+	const char *chip;	/* second to last token, the irq chip */
+	int chip_len;
+	const char *name;	/* last token, the device name */
+	int name_len;
+	int has_msi;		/* "MSI" appears in the trailing text */
+};
+
+#define is_row_space(c) ((c) == ' ' || (c) == '\t')
+#define is_row_digit(c) ((unsigned char)((c) - '0') < 10)
+#define is_row_end(c) ((c) == '\n' || (c) == 0)
+
+static int span_contains(const char *s, int len, const char *needle)
+{
+	int i, n = strlen(needle);
 
-		*c = 0;
-		c++;
-		number = strtoul(line, NULL, 10); // 中断号
+	for (i = 0; i + n <= len; i++)
+		if (!memcmp(s + i, needle, n))
+			return 1;
+	return 0;
+}
 
-		info = calloc(sizeof(struct irq_info), 1);
-		if (info) {
-			infxo->irq = number;
-			if (strstr(irq_name, "xen-dyn-event") != NULL) {
-				info->type = IRQ_TYPE_VIRT_EVENT;
-				info->class = IRQ_VIRT_EVENT;
-			} else {
-				info->type = IRQ_TYPE_LEGACY;
-				info->class = IRQ_OTHER;
+/*
+ * Parse the row of /proc/interrupts starting at p in a single forward
+ * pass, without copying or modifying it.  The first max_counts per cpu
+ * counts are also stored in counts, if that is set.  Returns the start of
+ * the next row, or NULL at the end of the buffer.
+ */
+static char *scan_irq_row(char *p, struct irq_row *row,
+			  unsigned int *counts, int max_counts)
+{
+	const char *tok;
+	uint64_t v;
+
+	memset(row, 0, sizeof(*row));
+	row->irq = -1;
+
+	if (!p || !*p)
+		return NULL;
+
+	while (is_row_space(*p))
+		p++;
+
+	if (is_row_digit(*p)) {
+		row->irq = 0;
+		while (is_row_digit(*p))
+			row->irq = row->irq * 10 + (*p++ - '0');
+		if (*p != ':')
+			row->irq = -1;
+	}
+
+	if (row->irq >= 0) {
+		p++;
+		/*
+		 * Fast path over the count columns, a count is a run of
+		 * digits that ends in whitespace or at the end of the row
+		 */
+		for (;;) {
+			while (is_row_space(*p))
+				p++;
+			if (!is_row_digit(*p))
+				break;
+			tok = p;
+			v = 0;
+			while (is_row_digit(*p))
+				v = v * 10 + (*p++ - '0');
+			if (!is_row_space(*p) && !is_row_end(*p)) {
+				p = (char *)tok;
+				break;
 			}
-			tmp_list = g_list_append(tmp_list, info);
+			if (row->cpus < max_counts)
+				counts[row->cpus] = v;
+			row->cpus++;
 		}
 
+		/* the remaining tokens name the chip and the device */
+		while (!is_row_end(*p)) {
+			while (is_row_space(*p))
+				p++;
+			if (is_row_end(*p))
+				break;
+			tok = p;
+			while (!is_row_space(*p) && !is_row_end(*p))
+				p++;
+			row->chip = row->name;
+			row->chip_len = row->name_len;
+			row->name = tok;
+			row->name_len = p - tok;
+			if (!row->has_msi)
+				row->has_msi = span_contains(tok, row->name_len, "MSI");
+		}
 	}
-	fclose(file);
-	free(line);
-	return tmp_list;
+
+	while (!is_row_end(*p))
+		p++;
+	return *p ? p + 1 : p;
 }
 
-void parse_proc_interrupts(void)
+/*
+ * Map the count columns of /proc/interrupts or /proc/softirqs to cpu
+ * numbers using the "CPU0 CPU1 ..." header.  Returns the number of
+ * columns, or -1 if the map can't be grown.
+ */
+static int parse_cpu_header(char *line, int **map, int *size)
 {
-	FILE *file;
-	char *line = NULL;
-	size_t size = 0;
+	int columns = 0, new_size;
+	int *new_map;
+	char *c;
+
+	for (c = strstr(line, "CPU"); c; c = strstr(c, "CPU")) {
+		c += 3;
+		if (columns == *size) {
+			new_size = *size ? *size * 2 : 64;
+			new_map = realloc(*map, new_size * sizeof(int));
+			if (!new_map)
+				return -1;
+			*map = new_map;
+			*size = new_size;
+		}
+		(*map)[columns++] = strtoul(c, &c, 10);
+	}
+
+	return columns;
+}
+
+static int grow_column_load(int columns)
+{
+	void *p;
+
+	if (columns <= column_load_size)
+		return 0;
+
+	p = realloc(column_load, columns * sizeof(struct column_load));
+	if (!p)
+		return -1;
+	column_load = p;
+	p = realloc(row_counts, columns * sizeof(unsigned int));
+	if (!p)
+		return -1;
+	row_counts = p;
+	column_load_size = columns;
+	return 0;
+}
+
+/*
+ * Bumped on every pass over /proc/interrupts, irqs the pass lists are
+ * stamped with it so the ones that went away can be found afterwards
+ */
+static unsigned int scan_generation;
 
-	file = fopen("/proc/interrupts", "r");
-	if (!file)
+/*
+ * Walk /proc/interrupts once, recording the per cpu counts of every irq
+ * if sample is set.  Irqs that the db doesn't know yet are added as they
+ * are found.  After the db is built they are also queued for placement,
+ * and irqs missing from the file are removed.  Only a change in the set
+ * of cpus needs a full rescan.
+ */
+
+static void scan_proc_interrupts(int building, int sample)
+{
+	struct irq_row row;
+	struct irq_info hint;
+	char *pos, *header;
+	int columns, added;
+
+	pos = proc_file_read(&proc_interrupts);
+	if (!pos)
 		return;
 
-	/* first line is the header we don't need; nuke it */
-	if (getline(&line, &size, file)==0) {
-		free(line);
-		fclose(file);
+	/* the header tells us which cpu each column belongs to */
+	header = proc_file_next_line(&pos);
+	if (!header)
 		return;
-	}
+	columns = parse_cpu_header(header, &irq_column_cpu, &irq_column_size);
+	if (columns < 0 || grow_column_load(columns) || set_irq_counter_columns(columns))
+		set_irq_counter_columns(0);
 
-	while (!feof(file)) {
-		int cpunr;
-		int	 number;
-		uint64_t count;
-		char *c, *c2;
-		struct irq_info *info;
-		char savedline[1024];
+	/* the current counts become the previous sample */
+	if (sample && irq_counters.count && irq_counters.columns)
+		memcpy(irq_counters.cpu_last, irq_counters.cpu_now,
+		       (size_t)irq_counters.count * irq_counters.columns * sizeof(unsigned int));
 
-		if (getline(&line, &size, file)==0)
-			break;
+	scan_generation++;
+
+	while ((pos = scan_irq_row(pos, &row, row_counts, irq_counters.columns))) {
+		struct irq_info *info;
 
         /*判断是否有msi中断*/
-		if (!proc_int_has_msi)
-			if (strstr(line, "MSI") != NULL)
-				proc_int_has_msi = 1;
+		if (row.has_msi)
+			proc_int_has_msi = 1;
 
 		/* lines with letters in front are special, like NMI count. Ignore */
 		// 仅处理 int 中断号
-		c = line;
-		while (isblank(*(c)))
-			c++;
-
-		if (!(*c>='0' && *c<='9'))
+		if (row.irq < 0)
 			break;
-		c = strchr(line, ':');
-		if (!c)
-			continue;
-
-		strncpy(savedline, line, sizeof(savedline));
 
-		*c = 0;
-		c++;
-		number = strtoul(line, NULL, 10);
-
-		info = get_irq_info(number);
-		if (!info) {  // 中断表里没有 number 编号的中断，需要重新 scan
+		if (!building && row.cpus != core_count) {
 			need_rescan = 1;
 			break;
 		}
 
-		count = 0; // 该 irq 总的中断数，各个 cpu 加起来
-		cpunr = 0; // cpu 数
-
-		c2=NULL;
-		while (1) {
-			uint64_t C;
-			C = strtoull(c, &c2, 10);
-			if (c==c2) /* end of numbers */
-				break;
-			count += C;
-			c=c2;
-			cpunr++;
+		info = get_irq_info(row.irq);
+		added = 0;
+		if (!info) {
+			memset(&hint, 0, sizeof(hint));
+			hint.irq = row.irq;
+			if (row.chip && span_contains(row.chip, row.chip_len, "xen-dyn-event")) {
+				hint.type = IRQ_TYPE_VIRT_EVENT;
+				hint.class = IRQ_VIRT_EVENT;
+			} else {
+				hint.type = IRQ_TYPE_LEGACY;
+				hint.class = IRQ_OTHER;
+			}
+			/*
+			 * An irq that turned up between rebuilds is classified
+			 * and placed on its own, the rest stay where they are
+			 */
+			info = building ? add_new_irq(row.irq, &hint) :
+					  add_hotplug_irq(row.irq, &hint);
+			if (!info)
+				continue;
+			added = !building && !(info->flags & IRQ_FLAG_BANNED);
 		}
-		if (cpunr != core_count) {
-			need_rescan = 1;
-			break;
+		info->seen = scan_generation;
+
+		if (irq_counters.columns && (sample || added)) {
+			memcpy(irq_cpu_now(info), row_counts,
+			       irq_counters.columns * sizeof(unsigned int));
+			/* its first interval starts now, not at boot */
+			if (added)
+				memcpy(irq_cpu_last(info), row_counts,
+				       irq_counters.columns * sizeof(unsigned int));
 		}
-
-		info->last_irq_count = info->irq_count;
-		info->irq_count = count;
+		if (added)
+			force_rebalance_irq(info, NULL);
 
 		/* is interrupt MSI based? */
 		/* 如果有MSI/MSI-X中断，进行标记*/
 		if ((info->type == IRQ_TYPE_MSI) || (info->type == IRQ_TYPE_MSIX))
 			msi_found_in_sysfs = 1;
 	}
+
+	/* irqs the kernel no longer lists are gone, drop them */
+	if (!building && !need_rescan)
+		remove_stale_irqs(scan_generation);
+	if (!building)
+		forget_hotplug_devs();
+
 	if ((proc_int_has_msi) && (!msi_found_in_sysfs) && (!need_rescan)) {
 		log(TO_ALL, LOG_WARNING, "WARNING: MSI interrupts found in /proc/interrupts\n");
 		log(TO_ALL, LOG_WARNING, "But none found in sysfs, you need to update your kernel\n");
@@ -202,63 +348,242 @@ void parse_proc_interrupts(void)
  		 */
 		msi_found_in_sysfs = 1;
 	}
-	fclose(file);
-	free(line);
 }
 
+/*
+ * Add the irqs listed in /proc/interrupts that aren't in the db yet, and
+ * take their first counts, in the same pass
+ */
+void collect_proc_interrupts(void)
+{
+	scan_proc_interrupts(1, 1);
+}
 
-static void accumulate_irq_count(struct irq_info *info, void *data)
+/*
+ * Read /proc/interrupts and /proc/stat together, ahead of the
+ * parse_proc_interrupts() and parse_proc_stat() calls of this cycle
+ */
+void prefetch_proc_counters(void)
 {
-	uint64_t *acc = data;
+	struct proc_file *files[] = { &proc_interrupts, &proc_stat };
 
-	*acc += (info->irq_count - info->last_irq_count);
+	proc_file_prefetch(files, 2);
 }
 
-static void assign_load_slice(struct irq_info *info, void *data)
+void parse_proc_interrupts(void)
 {
-	uint64_t *load_slice = data;
-	info->load = (info->irq_count - info->last_irq_count) * *load_slice;
+	scan_proc_interrupts(0, 1);
+}
 
-	/*
- 	 * Every IRQ has at least a load of 1
- 	 */
-	if (!info->load)
-		info->load++;
+/*
+ * Add and remove the irqs that came and went since the last cycle, between
+ * cycles.  The counts are left for the next cycle to sample, and the new
+ * irqs wait for it to be placed.
+ */
+void update_proc_interrupts(void)
+{
+	scan_proc_interrupts(0, 0);
 }
 
+
 /*
- * Recursive helper to estimate the number of irqs shared between
- * multiple topology objects that was handled by this particular object
+ * Fixed point shift for the per column nanoseconds per interrupt.  A cpu
+ * reports well under 2^40ns of irq time per interval, so the scaled rate
+ * times any interrupt count stays within 64 bits.
  */
-static uint64_t get_parent_branch_irq_count_share(struct topo_obj *d)
+#define LOAD_RATE_SHIFT 16
+
+static int softirq_group(const char *name, int len)
 {
-	uint64_t total_irq_count = 0;
+	if ((len == 6 && !strncmp(name, "NET_RX", 6)) ||
+	    (len == 6 && !strncmp(name, "NET_TX", 6)))
+		return SOFTIRQ_NET;
+	if ((len == 5 && !strncmp(name, "BLOCK", 5)) ||
+	    (len == 8 && !strncmp(name, "IRQ_POLL", 8)) ||
+	    (len == 12 && !strncmp(name, "BLOCK_IOPOLL", 12)))
+		return SOFTIRQ_BLOCK;
+	return SOFTIRQ_ALL;
+}
 
-	if (d->parent) {
-		total_irq_count = get_parent_branch_irq_count_share(d->parent);
-		total_irq_count /= g_list_length(*d->obj_type_list);
+static int irq_softirq_group(struct irq_info *info)
+{
+	switch (info->class) {
+	case IRQ_ETH:
+	case IRQ_GBETH:
+	case IRQ_10GBETH:
+		return SOFTIRQ_NET;
+	case IRQ_SCSI:
+		return SOFTIRQ_BLOCK;
+	default:
+		return SOFTIRQ_ALL;
 	}
+}
+
+/*
+ * Sample /proc/softirqs, summing the per cpu counts of each kind of
+ * softirq into its group
+ */
+static void parse_proc_softirqs(void)
+{
+	struct cpu_softirq *sirq;
+	char *pos, *line, *p;
+	const char *name;
+	int columns, col, group, cpu, i, g;
+	uint64_t v;
+
+	for (i = 0; i < nr_cpumask_bits; i++)
+		for (g = 0; g < SOFTIRQ_GROUPS; g++) {
+			cpu_softirq[i].last_count[g] = cpu_softirq[i].count[g];
+			cpu_softirq[i].count[g] = 0;
+		}
 
-	if (g_list_length(d->interrupts) > 0)
-		for_each_irq(d->interrupts, accumulate_irq_count, &total_irq_count);
+	pos = proc_file_read(&proc_softirqs);
+	if (!pos)
+		return;
 
-	return total_irq_count; 
+	line = proc_file_next_line(&pos);
+	if (!line)
+		return;
+	columns = parse_cpu_header(line, &softirq_column_cpu, &softirq_column_size);
+
+	while ((line = proc_file_next_line(&pos))) {
+		p = line;
+		while (is_row_space(*p))
+			p++;
+		name = p;
+		while (*p && *p != ':')
+			p++;
+		if (!*p)
+			continue;
+		group = softirq_group(name, p - name);
+		p++;
+
+		for (col = 0; col < columns; col++) {
+			while (is_row_space(*p))
+				p++;
+			if (!is_row_digit(*p))
+				break;
+			v = 0;
+			while (is_row_digit(*p))
+				v = v * 10 + (*p++ - '0');
+			cpu = softirq_column_cpu[col];
+			if (cpu < 0 || cpu >= nr_cpumask_bits)
+				continue;
+			sirq = &cpu_softirq[cpu];
+			sirq->count[group] += v;
+		}
+	}
 }
 
-static void compute_irq_branch_load_share(struct topo_obj *d, void *data __attribute__((unused)))
+/*
+ * The share of a cpu's softirq time taken by each of the grouped softirqs,
+ * in proportion to how many softirqs of each group ran.  SOFTIRQ_ALL is
+ * left to the caller.
+ */
+static void split_softirq_time(struct cpu_softirq *sirq, uint64_t ns[SOFTIRQ_GROUPS])
 {
-	uint64_t local_irq_counts = 0;
-	uint64_t load_slice;
-	int	load_divisor = g_list_length(d->children);
+	uint64_t delta[SOFTIRQ_GROUPS], total = 0;
+	int g;
 
-	d->load /= (load_divisor ? load_divisor : 1); 
+	for (g = 0; g < SOFTIRQ_GROUPS; g++) {
+		delta[g] = sirq->count[g] - sirq->last_count[g];
+		total += delta[g];
+	}
+
+	for (g = SOFTIRQ_ALL + 1; g < SOFTIRQ_GROUPS; g++) {
+		ns[g] = 0;
+		if (total)
+			ns[g] = (sirq->time * ((delta[g] << LOAD_RATE_SHIFT) / total)) >> LOAD_RATE_SHIFT;
+	}
+}
+
+/*
+ * Split the irq and softirq time each cpu reported across the irqs that
+ * fired on it, in proportion to how often each of them fired there.  The
+ * time of network and block softirqs only goes to irqs of the matching
+ * class, unless none of those fired on the cpu.  Both passes are flat
+ * loops over the per cpu count matrix.
+ */
+static void attribute_irq_load(void)
+{
+	int columns = irq_counters.columns;
+	int count = irq_counters.count;
+	unsigned int *now, *last;
+	struct column_load *col;
+	struct topo_obj *cpu;
+	uint64_t ns[SOFTIRQ_GROUPS];
+	uint64_t load, delta;
+	int i, c, g;
+
+	if (!columns)
+		return;
+
+	memset(column_load, 0, columns * sizeof(struct column_load));
+	for (i = 0; i < count; i++) {
+		now = &irq_counters.cpu_now[(size_t)i * columns];
+		last = &irq_counters.cpu_last[(size_t)i * columns];
+		g = irq_softirq_group(irq_counters.info[i]);
+		for (c = 0; c < columns; c++) {
+			delta = now[c] - last[c];
+			column_load[c].total[SOFTIRQ_ALL] += delta;
+			if (g != SOFTIRQ_ALL)
+				column_load[c].total[g] += delta;
+		}
+	}
+
+	for (c = 0; c < columns; c++) {
+		col = &column_load[c];
+		memset(col->rate, 0, sizeof(col->rate));
+		cpu = find_cpu_core(irq_column_cpu[c]);
+		if (!cpu || !col->total[SOFTIRQ_ALL])
+			continue;
 
-	if (g_list_length(d->interrupts) > 0) {
-		local_irq_counts = get_parent_branch_irq_count_share(d);
-		load_slice = local_irq_counts ? (d->load / local_irq_counts) : 1;
-		for_each_irq(d->interrupts, assign_load_slice, &load_slice);
+		split_softirq_time(&cpu_softirq[cpu->number], ns);
+		/* everything but the grouped softirqs is shared by all irqs */
+		ns[SOFTIRQ_ALL] = cpu->load;
+		for (g = SOFTIRQ_ALL + 1; g < SOFTIRQ_GROUPS; g++) {
+			if (ns[g] > ns[SOFTIRQ_ALL])
+				ns[g] = ns[SOFTIRQ_ALL];
+			ns[SOFTIRQ_ALL] -= ns[g];
+		}
+		for (g = SOFTIRQ_ALL + 1; g < SOFTIRQ_GROUPS; g++) {
+			if (!col->total[g]) {
+				ns[SOFTIRQ_ALL] += ns[g];
+				continue;
+			}
+			col->rate[g] = (ns[g] << LOAD_RATE_SHIFT) / col->total[g];
+		}
+		col->rate[SOFTIRQ_ALL] = (ns[SOFTIRQ_ALL] << LOAD_RATE_SHIFT) /
+					 col->total[SOFTIRQ_ALL];
 	}
 
+	for (i = 0; i < count; i++) {
+		now = &irq_counters.cpu_now[(size_t)i * columns];
+		last = &irq_counters.cpu_last[(size_t)i * columns];
+		g = irq_softirq_group(irq_counters.info[i]);
+		load = 0;
+		if (g == SOFTIRQ_ALL) {
+			for (c = 0; c < columns; c++)
+				load += (uint64_t)(now[c] - last[c]) * column_load[c].rate[SOFTIRQ_ALL];
+		} else {
+			for (c = 0; c < columns; c++)
+				load += (uint64_t)(now[c] - last[c]) *
+					(column_load[c].rate[SOFTIRQ_ALL] + column_load[c].rate[g]);
+		}
+		load >>= LOAD_RATE_SHIFT;
+		/*
+		 * Every IRQ has at least a load of 1
+		 */
+		irq_counters.load[i] = load ? load : 1;
+	}
+}
+
+static void compute_branch_load(struct topo_obj *d, void *data __attribute__((unused)))
+{
+	int	load_divisor = d->num_children;
+
+	d->load /= (load_divisor ? load_divisor : 1); 
+
 	if (d->parent)  // 将自身的负载加入到它的 parent
 		d->parent->load += d->load;
 }
@@ -271,47 +596,96 @@ static void reset_load(struct topo_obj *d, void *data __attribute__((unused)))
 	d->load = 0;
 }
 
+/*
+ * The fields of a cpu row of /proc/stat that we use
+ */
+struct stat_row {
+	int cpu;		/* -1 for the aggregate "cpu" row */
+	int fields;		/* number of fields parsed, at most STAT_FIELDS */
+	uint64_t irq;
+	uint64_t softirq;
+};
+
+/* user nice system idle iowait irq softirq */
+#define STAT_FIELDS 7
+
+/*
+ * Parse the cpu row of /proc/stat starting at p, stopping after the softirq
+ * field.  Returns the start of the next row, or NULL at the first row that
+ * isn't a cpu row.
+ */
+static char *scan_stat_row(char *p, struct stat_row *row)
+{
+	uint64_t v;
+
+	if (!p || p[0] != 'c' || p[1] != 'p' || p[2] != 'u')
+		return NULL;
+	p += 3;
+
+	row->cpu = -1;
+	row->fields = 0;
+	row->irq = 0;
+	row->softirq = 0;
+	if (is_row_digit(*p)) {
+		row->cpu = 0;
+		while (is_row_digit(*p))
+			row->cpu = row->cpu * 10 + (*p++ - '0');
+	}
+
+	while (row->fields < STAT_FIELDS) {
+		while (is_row_space(*p))
+			p++;
+		if (!is_row_digit(*p))
+			break;
+		v = 0;
+		while (is_row_digit(*p))
+			v = v * 10 + (*p++ - '0');
+		if (row->fields == 5)
+			row->irq = v;
+		else if (row->fields == 6)
+			row->softirq = v;
+		row->fields++;
+	}
+
+	p = strchr(p, '\n');
+	return p ? p + 1 : NULL;
+}
+
 void parse_proc_stat(void)
 {
-	FILE *file;
-	char *line = NULL;
-	size_t size = 0;
-	int cpunr, rc, cpucount;
+	struct stat_row row;
+	struct cpu_softirq *sirq;
+	char *pos;
+	int cpucount;
 	struct topo_obj *cpu;
-	unsigned long long irq_load, softirq_load;
 
-	file = fopen("/proc/stat", "r");
-	if (!file) {
-		log(TO_ALL, LOG_WARNING, "WARNING cant open /proc/stat.  balacing is broken\n");
-		return;
+	if (!cpu_softirq) {
+		cpu_softirq = calloc(nr_cpumask_bits, sizeof(struct cpu_softirq));
+		if (!cpu_softirq) {
+			log(TO_ALL, LOG_WARNING, "WARNING no memory for softirq stats.  balancing is broken\n");
+			return;
+		}
 	}
 
-	/* first line is the header we don't need; nuke it */
-	if (getline(&line, &size, file)==0) { // 第一行为 cpu 信息汇总，不做处理
-		free(line);
-		log(TO_ALL, LOG_WARNING, "WARNING read /proc/stat. balancing is broken\n");
-		fclose(file);
+	pos = proc_file_read(&proc_stat);
+	if (!pos) {
+		log(TO_ALL, LOG_WARNING, "WARNING cant open /proc/stat.  balacing is broken\n");
 		return;
 	}
 
 	cpucount = 0;
-	while (!feof(file)) {
-		if (getline(&line, &size, file)==0)
-			break;
-
-		if (!strstr(line, "cpu")) // 仅处理包含 cpu 字段的行
-			break;
-
-		cpunr = strtoul(&line[3], NULL, 10); // cpuname
+	while ((pos = scan_stat_row(pos, &row))) {
+		/* the aggregate row comes first, we don't need it */
+		if (row.cpu < 0 || row.cpu >= nr_cpumask_bits) // 第一行为 cpu 信息汇总，不做处理
+			continue;
 
-		if (cpu_isset(cpunr, banned_cpus)) // 被 ban 的 cpu 不统计
+		if (cpu_isset(row.cpu, banned_cpus)) // 被 ban 的 cpu 不统计
 			continue;
 
-		rc = sscanf(line, "%*s %*u %*u %*u %*u %*u %llu %llu", &irq_load, &softirq_load); // 第 7 行为硬中断，第 8 行为软中断
-		if (rc < 2)
+		if (row.fields < STAT_FIELDS)
 			break;
 
-		cpu = find_cpu_core(cpunr); // 从 cpus 中获取之前放入的 cpu，以备填充 load 和 last_load 字段
+		cpu = find_cpu_core(row.cpu); // 从 cpus 中获取之前放入的 cpu，以备填充 load 和 last_load 字段
 
 		if (!cpu)
 			break;
@@ -324,7 +698,7 @@ void parse_proc_stat(void)
 		 * 对于每一个 cpu 结构，将 irq and softirq 叠加，并放入 device tree
  		 */
 		if (cycle_count) {
-			cpu->load = (irq_load + softirq_load) - (cpu->last_load); // 当前的负载与上次的做 diff
+			cpu->load = (row.irq + row.softirq) - (cpu->last_load); // 当前的负载与上次的做 diff
 			/*
 			 * the [soft]irq_load values are in jiffies, with
 			 * HZ jiffies per second.  Convert the load to nanoseconds
@@ -333,11 +707,14 @@ void parse_proc_stat(void)
 			 */
 			cpu->load *= NSEC_PER_SEC/HZ; // 结果转换成 ns
 		}
-		cpu->last_load = (irq_load + softirq_load);
+		cpu->last_load = (row.irq + row.softirq);
+
+		sirq = &cpu_softirq[row.cpu];
+		if (cycle_count)
+			sirq->time = (row.softirq - sirq->last_time) * (NSEC_PER_SEC/HZ);
+		sirq->last_time = row.softirq;
 	}
 
-	fclose(file);
-	free(line);
 	if (cpucount != get_cpu_count()) {
 		log(TO_ALL, LOG_WARNING, "WARNING, didn't collect load info for all cpus, balancing is broken\n");
 		return;
@@ -350,12 +727,14 @@ void parse_proc_stat(void)
 	for_each_object(cache_domains, reset_load, NULL);
 
 	/*
- 	 * Now that we have load for each cpu attribute a fair share of the load
- 	 * to each irq on that cpu
+ 	 * Now that we have load for each cpu attribute it to the irqs that
+ 	 * fired there, then sum it up the tree
  	 */
-	for_each_object(cpus, compute_irq_branch_load_share, NULL);
-	for_each_object(cache_domains, compute_irq_branch_load_share, NULL);
-	for_each_object(packages, compute_irq_branch_load_share, NULL);
-	for_each_object(numa_nodes, compute_irq_branch_load_share, NULL);
+	parse_proc_softirqs();
+	attribute_irq_load();
+	for_each_object(cpus, compute_branch_load, NULL);
+	for_each_object(cache_domains, compute_branch_load, NULL);
+	for_each_object(packages, compute_branch_load, NULL);
+	for_each_object(numa_nodes, compute_branch_load, NULL);
 
 }
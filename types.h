@@ -5,6 +5,12 @@
 
 #include "cpumask.h"
 
+/*
+ * Id of a cpumask interned in the mask pool, see maskpool.c
+ */
+typedef unsigned int cpumask_id_t;
+#define CPUMASK_ID_EMPTY 0
+
 // 树的层级
 #define	BALANCE_NONE		0
 #define BALANCE_PACKAGE 	1
@@ -36,6 +42,18 @@
  */
 #define IRQ_FLAG_BANNED	1
 
+/*
+ * Intrusive list of irq_info structs, linked through irq_info->prev/next.
+ * An irq sits on at most one of these at a time: rebalance_irq_list or
+ * the interrupts list of the object it is assigned to.
+ */
+struct irq_info;
+struct irq_list {
+	struct irq_info *head;
+	struct irq_info *tail;
+	unsigned int count;
+};
+
 // node 类型
 enum obj_type_e {
 	OBJ_TYPE_CPU,
@@ -50,11 +68,24 @@ struct topo_obj {
 	enum obj_type_e obj_type;
 	int number;
 	int powersave_mode;
-	cpumask_t mask;
-	GList *interrupts;
+	cpumask_id_t mask;
+	struct irq_list interrupts;
 	struct topo_obj *parent;
 	GList *children;
+	int num_children;
+	int heap_pos;		/* position in the placement heap, see placement.c */
 	GList **obj_type_list;
+	int *obj_type_count;	/* length of *obj_type_list */
+};
+
+/*
+ * Entry in the dense per cpu index, see cpu_topo_index
+ */
+struct cpu_topo {
+	struct topo_obj *cpu;
+	struct topo_obj *cache_domain;
+	struct topo_obj *package;
+	struct topo_obj *numa_node;
 };
 
 struct irq_info {
@@ -64,13 +95,84 @@ struct irq_info {
 	int level;
 	int flags;
 	struct topo_obj *numa_node;
-	cpumask_t cpumask;
-	cpumask_t affinity_hint;
-	uint64_t irq_count;
-	uint64_t last_irq_count;
-	uint64_t load;
+	cpumask_id_t cpumask;
+	cpumask_id_t affinity_hint;
 	int moved;
     struct topo_obj *assigned_obj;
+	struct irq_list *list;
+	struct irq_info *prev;
+	struct irq_info *next;
+	int slot;		/* index into irq_counters */
+	unsigned int seen;	/* last /proc/interrupts pass that listed the irq */
+	cpumask_id_t applied_mask;	/* last mask given to the kernel, see activate.c */
+	unsigned int applied_gen;
+	cpumask_id_t effective_mask;	/* where the kernel delivers it, if known */
 };
 
+/*
+ * Per cycle irq counters.  They are kept out of irq_info, in arrays indexed
+ * by irq_info->slot, so that the accounting passes stream through a few
+ * dense arrays rather than touching every irq_info.
+ */
+struct irq_counters {
+	uint64_t *load;
+	struct irq_info **info;
+	int count;		/* slots in use */
+	int size;		/* slots allocated */
+	/*
+	 * Per cpu counts, one row of columns entries per slot, in the
+	 * column order of /proc/interrupts
+	 */
+	unsigned int *cpu_now;
+	unsigned int *cpu_last;
+	int columns;
+};
+
+/*
+ * A file that is re-read every cycle through a descriptor that stays open,
+ * see fileio.c
+ */
+struct proc_file {
+	const char *path;
+	int fd;
+	int no_pread;
+	char *buf;
+	size_t size;
+	size_t len;
+	int prefetched;		/* buf holds the start of this cycle's contents */
+};
+
+#define PROC_FILE_INIT(p) { .path = (p), .fd = -1 }
+
+/*
+ * One open, read or write, close of a small file, run in batches by
+ * io_batch_run(), see fileio.c
+ */
+struct io_op {
+	char path[64];
+	int write;
+	char *buf;
+	size_t len;		/* bytes to write, or size of buf for a read */
+	int fd;
+	int opened;		/* the file could be opened */
+	int done;		/* result is final */
+	ssize_t result;		/* bytes transferred, or -errno */
+};
+
+/*
+ * Pool of fixed size objects, see objpool.c
+ */
+struct pool_chunk;
+struct free_obj;
+struct obj_pool {
+	size_t obj_size;
+	size_t objs_per_chunk;
+	struct pool_chunk *chunks;
+	struct pool_chunk *current;
+	size_t used;
+	struct free_obj *free_list;
+};
+
+#define OBJ_POOL_INIT(type, n) { .obj_size = sizeof(type), .objs_per_chunk = (n) }
+
 #endif
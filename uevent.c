@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2012, Neil Horman <nhorman@tuxdriver.com>
+ *
+ * This file is part of irqbalance
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Kernel uevents tell us about cpu hotplug and pci devices coming and going
+ * as it happens, rather than at the next look at /proc/interrupts.  The
+ * socket is waited on in place of the sleep between balancing cycles.  A
+ * cpu event cuts the sleep short for a rescan.  Pci events only have the
+ * irq db brought up to date once they settle, and the new irqs are placed
+ * by the next cycle as usual.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "irqbalance.h"
+
+#define UEVENT_BUFFER_SIZE	8192
+#define UEVENT_RCVBUF		(1024 * 1024)
+/* how long pci events must stop coming before the irqs are looked at, in ms */
+#define UEVENT_SETTLE		250
+
+/* what the pending events ask for */
+#define UEVENT_CPU	(1 << 0)	/* cpu topology changed, rescan */
+#define UEVENT_IRQ	(1 << 1)	/* irqs may have come or gone */
+
+static int uevent_fd = -1;
+
+/*
+ * Open the uevent socket.  Without it we fall back to noticing hotplug in
+ * /proc/interrupts.
+ */
+int uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int size = UEVENT_RCVBUF;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		goto fail;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* kernel events, not the ones udev resends */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		goto fail;
+	}
+
+	/* a burst of hotplug events must not overflow the socket */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	uevent_fd = fd;
+	return 0;
+
+fail:
+	log(TO_CONSOLE, LOG_INFO, "Cannot listen for uevents, hotplug is noticed at the next scan\n");
+	return -1;
+}
+
+void uevent_close(void)
+{
+	if (uevent_fd >= 0)
+		close(uevent_fd);
+	uevent_fd = -1;
+}
+
+/*
+ * An event is "ACTION@DEVPATH" followed by KEY=VALUE strings, all NUL
+ * terminated.  Only the action, the subsystem and the path matter to us.
+ */
+static int parse_uevent(char *buf, size_t len)
+{
+	const char *action = NULL, *subsystem = NULL, *devpath = NULL;
+	const char *name;
+	char *p, *end = buf + len;
+
+	if (!len || !memchr(buf, '@', strnlen(buf, len)))
+		return 0;
+
+	for (p = buf; p < end; p += strnlen(p, end - p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+	}
+	if (!action || !subsystem)
+		return 0;
+
+	if (!strcmp(subsystem, "cpu")) {
+		if (!strcmp(action, "online") || !strcmp(action, "offline") ||
+		    !strcmp(action, "add") || !strcmp(action, "remove"))
+			return UEVENT_CPU;
+		return 0;
+	}
+
+	/*
+	 * Drivers set up their msi vectors when they bind to a device, so
+	 * irqs show up on bind and go away on unbind or removal
+	 */
+	if (!strcmp(subsystem, "pci")) {
+		if (!strcmp(action, "add") || !strcmp(action, "remove") ||
+		    !strcmp(action, "bind") || !strcmp(action, "unbind")) {
+			/* the last part of the path is the pci address */
+			if (devpath) {
+				name = strrchr(devpath, '/');
+				invalidate_dev_cache(name ? name + 1 : devpath);
+			}
+			return UEVENT_IRQ;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Drain the socket and return what the queued events ask for
+ */
+static int read_uevents(void)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	struct sockaddr_nl addr;
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg;
+	ssize_t len;
+	int events = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		len = recvmsg(uevent_fd, &msg, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/*
+			 * We lost events, so we can't tell what changed
+			 */
+			if (errno == ENOBUFS) {
+				invalidate_dev_cache(NULL);
+				events |= UEVENT_CPU | UEVENT_IRQ;
+				continue;
+			}
+			break;
+		}
+
+		/* only believe the kernel */
+		if (msg.msg_namelen == sizeof(addr) && addr.nl_pid != 0)
+			continue;
+
+		buf[len] = '\0';
+		events |= parse_uevent(buf, len);
+	}
+
+	return events;
+}
+
+static void timespec_add(struct timespec *a, const struct timespec *b)
+{
+	a->tv_sec += b->tv_sec;
+	a->tv_nsec += b->tv_nsec;
+	if (a->tv_nsec >= 1000000000) {
+		a->tv_sec++;
+		a->tv_nsec -= 1000000000;
+	}
+}
+
+/* milliseconds from now until then */
+static long ms_until(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (then->tv_sec - now.tv_sec) * 1000 +
+	       (then->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/*
+ * Sleep like sleep_approx(), but come back early when a uevent needs us to
+ * rescan the topology.  The irqs of pci devices that come and go are added
+ * and removed in the meantime, once a burst of events has died down.
+ */
+void uevent_wait(int seconds)
+{
+	struct timespec ts, deadline, settle;
+	struct timespec settle_time = { 0, UEVENT_SETTLE * 1000000L };
+	struct timeval tv;
+	struct pollfd pfd;
+	long timeout, settle_timeout;
+	int events, pending = 0;
+
+	if (uevent_fd < 0) {
+		sleep_approx(seconds);
+		return;
+	}
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = seconds;
+	ts.tv_nsec = -tv.tv_usec*1000;
+	while (ts.tv_nsec < 0) {
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add(&deadline, &ts);
+
+	pfd.fd = uevent_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* what is still pending at the deadline is left to the cycle */
+		timeout = ms_until(&deadline);
+		if (timeout <= 0)
+			return;
+
+		if (pending) {
+			settle_timeout = ms_until(&settle);
+			if (settle_timeout <= 0) {
+				pending = 0;
+				update_proc_interrupts();
+				if (need_rescan)
+					return;
+				continue;
+			}
+			if (settle_timeout < timeout)
+				timeout = settle_timeout;
+		}
+
+		/* a signal ends the sleep, as it does for sleep_approx() */
+		events = poll(&pfd, 1, timeout);
+		if (events < 0)
+			return;
+		if (!events)
+			continue;
+
+		events = read_uevents();
+		if (events & UEVENT_CPU) {
+			log(TO_CONSOLE, LOG_INFO, "CPU hotplug event received\n");
+			need_rescan = 1;
+			return;
+		}
+		if (events & UEVENT_IRQ) {
+			if (!pending)
+				log(TO_CONSOLE, LOG_INFO, "PCI hotplug event received\n");
+			pending = 1;
+			clock_gettime(CLOCK_MONOTONIC, &settle);
+			timespec_add(&settle, &settle_time);
+		}
+	}
+}